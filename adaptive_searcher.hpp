@@ -0,0 +1,78 @@
+#pragma once
+
+#include <memory>
+#include <utility>
+#include <cstddef>
+
+#include "bounding_box_hierarchy.hpp"
+#include "blocked_exhaustive_searcher.hpp"
+#include "hierarchy_common.hpp"
+
+
+// searches small collections of elements exhaustively and larger collections with a bounding_box_hierarchy
+// below the crossover point, testing every element's bounding box with vector instructions is faster than
+// traversing a tree
+template<class T,
+         size_t Dimension = element_bounding_box_traits<T>::dimension,
+         class Scalar = typename element_bounding_box_traits<T>::scalar_type>
+class adaptive_searcher
+{
+  public:
+    using exhaustive_searcher_type = blocked_exhaustive_searcher<T,Dimension,Scalar>;
+
+    using bounding_box_hierarchy_type = bounding_box_hierarchy<T,Dimension,Scalar>;
+
+    using element_type = T;
+
+    using bounding_box_type = typename bounding_box_hierarchy_type::bounding_box_type;
+
+    // the demo program measures the crossover with small triangles at 128 or 256 elements, depending on the machine and the run,
+    // and the two searchers take about as long as each other at 128. the lower measurement is the default because exhaustive
+    // search slows in proportion to the number of elements, while a tree only slows with its depth, so a crossover which is
+    // too low costs less than one which is too high
+    static constexpr size_t default_crossover = 128;
+
+
+    // elements are searched exhaustively if there are fewer than crossover of them
+    template<class ContiguousRange, class Bounder = call_member_bounding_box>
+    explicit adaptive_searcher(const ContiguousRange& elements,
+                               Bounder bounder = call_member_bounding_box(),
+                               size_t crossover = default_crossover)
+    {
+      if(size_t(elements.end() - elements.begin()) < crossover)
+      {
+        exhaustive_searcher_ = std::make_unique<exhaustive_searcher_type>(elements, bounder);
+      }
+      else
+      {
+        bounding_box_hierarchy_ = std::make_unique<bounding_box_hierarchy_type>(elements, bounder);
+      }
+    }
+
+
+    bool is_exhaustive() const
+    {
+      return static_cast<bool>(exhaustive_searcher_);
+    }
+
+
+    bounding_box_type bounding_box() const
+    {
+      return is_exhaustive() ? exhaustive_searcher_->bounding_box() : bounding_box_hierarchy_->bounding_box();
+    }
+
+
+    template<class... Args>
+    auto intersect(Args&&... args) const
+    {
+      return is_exhaustive() ?
+        exhaustive_searcher_->intersect(std::forward<Args>(args)...) :
+        bounding_box_hierarchy_->intersect(std::forward<Args>(args)...);
+    }
+
+
+  private:
+    std::unique_ptr<exhaustive_searcher_type> exhaustive_searcher_;
+    std::unique_ptr<bounding_box_hierarchy_type> bounding_box_hierarchy_;
+};
+
@@ -0,0 +1,211 @@
+#pragma once
+
+#include <array>
+#include <limits>
+#include <algorithm>
+#include <cstddef>
+#include <cmath>
+#include <vector>
+
+#include "bounding_box_traits.hpp"
+#include "hierarchy_common.hpp"
+
+
+// an exhaustive searcher which tests the bounding boxes of blocks of elements against a ray at once
+// and calls intersector only on elements whose bounding boxes the ray hits before the nearest result so far
+// the boxes are stored as a structure of arrays, so a block can be tested with vector instructions
+template<class T,
+         size_t Dimension = element_bounding_box_traits<T>::dimension,
+         class Scalar = typename element_bounding_box_traits<T>::scalar_type>
+class blocked_exhaustive_searcher
+{
+  public:
+    using element_type = T;
+
+    using bounding_box_type = typename select_bounding_box_type<T,Dimension,Scalar>::type;
+
+    using scalar_type = Scalar;
+
+    static constexpr size_t dimension = Dimension;
+
+    // the number of elements whose bounding boxes are tested together by intersect()
+    static constexpr size_t block_size = 16;
+
+    template<class ContiguousRange, class Bounder = call_member_bounding_box>
+    blocked_exhaustive_searcher(const ContiguousRange& elements,
+                                Bounder bounder = call_member_bounding_box(),
+                                Scalar epsilon = std::numeric_limits<Scalar>::epsilon())
+      : begin_(&*elements.begin()),
+        end_(&*elements.end()),
+        bounding_box_(bounding_box(elements, bounder, epsilon)),
+        element_bounding_boxes_(elements, bounder, epsilon)
+    {}
+
+    bounding_box_type bounding_box() const
+    {
+      return bounding_box_;
+    }
+
+    template<class Point, class Vector, class U,
+             class Function1 = call_member_intersect,
+             class Function2 = default_projection<Scalar>>
+    U intersect(Point origin, Vector direction, U init,
+                Function1 intersector = call_member_intersect(),
+                Function2 hit_time = default_projection<Scalar>()) const
+    {
+      U result = init;
+      auto result_t = hit_time(result);
+
+      std::array<Scalar,Dimension> one_over_direction;
+      for_each_axis<Dimension>([&](auto axis)
+      {
+        one_over_direction[axis] = Scalar(1) / direction[axis];
+      });
+
+      size_t num_elements = end_ - begin_;
+
+      for(size_t block_begin = 0; block_begin < num_elements; block_begin += block_size)
+      {
+        // test a block of bounding boxes against the ray at once
+        std::array<unsigned char,block_size> hits;
+        element_bounding_boxes_.intersect_block(block_begin, origin, one_over_direction, result_t, hits);
+
+        // only call intersector for elements whose bounding boxes the ray hits before the nearest result so far
+        // the hits of the padding past the last element are ignored
+        size_t block_end = std::min(block_begin + block_size, num_elements);
+        for(size_t i = block_begin; i < block_end; ++i)
+        {
+          if(hits[i - block_begin])
+          {
+            auto current_result = intersector(begin_[i], origin, direction, result);
+            auto current_t = hit_time(current_result);
+
+            if(current_t < result_t)
+            {
+              result = current_result;
+              result_t = current_t;
+            }
+          }
+        }
+      }
+
+      return result;
+    }
+
+  private:
+    template<class ContiguousRange, class Bounder>
+    static bounding_box_type bounding_box(const ContiguousRange& elements, Bounder bounder, Scalar epsilon)
+    {
+      Scalar inf = std::numeric_limits<Scalar>::infinity();
+
+      bounding_box_type result;
+      for_each_axis<Dimension>([&](auto i)
+      {
+        result[0][i] =  inf;
+        result[1][i] = -inf;
+      });
+
+      for(const auto& element : elements)
+      {
+        auto bounding_box = bounder(element);
+
+        for_each_axis<Dimension>([&](auto i)
+        {
+          result[0][i] = std::min(result[0][i], bounding_box[0][i]);
+          result[1][i] = std::max(result[1][i], bounding_box[1][i]);
+        });
+      }
+
+      for_each_axis<Dimension>([&](auto i)
+      {
+        result[0][i] -= epsilon;
+        result[1][i] += epsilon;
+      });
+
+      return result;
+    }
+
+    // the elements' bounding boxes stored as a structure of arrays, one array per axis and side,
+    // so that a block of boxes can be tested against a ray with vector instructions
+    struct structure_of_bounding_boxes
+    {
+      template<class ContiguousRange, class Bounder>
+      structure_of_bounding_boxes(const ContiguousRange& elements, Bounder bounder, Scalar epsilon)
+      {
+        size_t num_elements = elements.end() - elements.begin();
+
+        // pad to a whole number of blocks so that intersect_block never reads past the end
+        // the padding boxes are zero, and rays may hit them, so intersect() must skip the padding's hits
+        size_t num_padded_elements = block_size * ((num_elements + block_size - 1) / block_size);
+
+        for_each_axis<Dimension>([&](auto axis)
+        {
+          min_corners_[axis].assign(num_padded_elements, Scalar(0));
+          max_corners_[axis].assign(num_padded_elements, Scalar(0));
+        });
+
+        size_t i = 0;
+        for(const auto& element : elements)
+        {
+          auto box = bounder(element);
+
+          // widen each box by epsilon so that the box test never rejects an element the ray grazes
+          for_each_axis<Dimension>([&](auto axis)
+          {
+            min_corners_[axis][i] = box[0][axis] - epsilon * std::max(Scalar(1), std::abs(box[0][axis]));
+            max_corners_[axis][i] = box[1][axis] + epsilon * std::max(Scalar(1), std::abs(box[1][axis]));
+          });
+
+          ++i;
+        }
+      }
+
+      template<class Point, class TimeType>
+      void intersect_block(size_t block_begin,
+                           const Point& origin,
+                           const std::array<Scalar,Dimension>& one_over_direction,
+                           TimeType t_bound,
+                           std::array<unsigned char,block_size>& hits) const
+      {
+        std::array<Scalar,block_size> tmin;
+        std::array<Scalar,block_size> tmax;
+        tmin.fill(-std::numeric_limits<Scalar>::infinity());
+        tmax.fill( std::numeric_limits<Scalar>::infinity());
+
+        for_each_axis<Dimension>([&](auto axis)
+        {
+          const Scalar* min_corners = min_corners_[axis].data() + block_begin;
+          const Scalar* max_corners = max_corners_[axis].data() + block_begin;
+          Scalar o = origin[axis];
+          Scalar inv = one_over_direction[axis];
+
+          // this loop has no branches, so the compiler may vectorize it
+          for(size_t j = 0; j < block_size; ++j)
+          {
+            Scalar t0 = (min_corners[j] - o) * inv;
+            Scalar t1 = (max_corners[j] - o) * inv;
+
+            Scalar near_t = t0 < t1 ? t0 : t1;
+            Scalar far_t  = t0 < t1 ? t1 : t0;
+
+            tmin[j] = near_t > tmin[j] ? near_t : tmin[j];
+            tmax[j] = far_t  < tmax[j] ? far_t  : tmax[j];
+          }
+        });
+
+        for(size_t j = 0; j < block_size; ++j)
+        {
+          hits[j] = (tmin[j] <= tmax[j]) & (tmin[j] < t_bound) & (tmax[j] >= Scalar(0));
+        }
+      }
+
+      std::array<std::vector<Scalar>,Dimension> min_corners_;
+      std::array<std::vector<Scalar>,Dimension> max_corners_;
+    };
+
+    const T* begin_;
+    const T* end_;
+    bounding_box_type bounding_box_;
+    structure_of_bounding_boxes element_bounding_boxes_;
+};
+
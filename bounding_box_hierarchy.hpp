@@ -8,73 +8,61 @@
 #include <algorithm>
 #include <tuple>
 #include <cmath>
-
-#include "memoized_bounder.hpp"
+#include <limits>
+#include <iterator>
+#include <initializer_list>
+#include <thread>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+#include "bounding_box_traits.hpp"
+#include "hierarchy_common.hpp"
 #include "partitioner.hpp"
 
 
-template<class T>
+// Dimension and Scalar describe the bounding boxes of the hierarchy
+// by default, they are taken from the result of T::bounding_box() if it exists, or are 3 and float otherwise
+// Allocator allocates the hierarchy's nodes, e.g. huge_page_allocator
+//
+// thread safety: a bounding_box_hierarchy is immutable after construction, and its const member functions
+// may be called concurrently from any number of threads. the hierarchy refers to the elements it was built
+// from without owning them, so they must outlive it and must not be modified while it is queried.
+// shared_bounding_box_hierarchy owns its elements for cases where that is inconvenient to guarantee
+template<class T,
+         size_t Dimension = element_bounding_box_traits<T>::dimension,
+         class Scalar = typename element_bounding_box_traits<T>::scalar_type,
+         class Allocator = std::allocator<T>>
 class bounding_box_hierarchy
 {
   private:
-    struct call_member_intersect
-    {
-      template<class... Args>
-      auto operator()(const T& element, Args&&... args) const
-      {
-        return element.intersect(std::forward<Args>(args)...);
-      }
-    };
-
-
-    struct call_member_bounding_box
+    // calls f(element, result) and returns false if f asked to stop by returning false
+    template<class Function, class U>
+    static auto invoke_intersection_callback(Function& f, const T& element, const U& result, int) -> decltype(bool(f(element, result)))
     {
-      auto operator()(const T& element) const
-      {
-        return element.bounding_box();
-      }
-    };
-
+      return f(element, result);
+    }
 
-    struct default_projection
+    template<class Function, class U>
+    static bool invoke_intersection_callback(Function& f, const T& element, const U& result, ...)
     {
-      float operator()(float x) const
-      {
-        return x;
-      }
-
-      template<class... Types>
-      auto operator()(const std::tuple<Types...>& t) const
-      {
-        return std::get<float>(t);
-      }
+      f(element, result);
+      return true;
+    }
 
-      template<class T1, class T2>
-      auto operator()(const std::pair<T1,T2>& p) const
-      {
-        return std::get<float>(p);
-      }
-    };
 
+  public:
+    using element_type = T;
 
-    struct select_bounding_box_type
-    {
-      // if U::bounding_box() exists, use its type as the bounding box type
-      template<class U>
-      static auto test(int) -> decltype(std::declval<U>().bounding_box());
+    using bounding_box_type = typename select_bounding_box_type<T,Dimension,Scalar>::type;
 
-      // otherwise, a bounding box is an array of two arrays of three floats
-      template<class>
-      static std::array<std::array<float,3>,2> test(...);
+    using scalar_type = Scalar;
 
-      using type = decltype(test<T>(0));
-    };
+    static constexpr size_t dimension = Dimension;
 
+    using allocator_type = Allocator;
 
-  public:
-    using element_type = T;
-
-    using bounding_box_type = typename select_bounding_box_type::type;
+    static_assert(bounding_box_traits<bounding_box_type>::dimension == Dimension, "bounding_box_type must have Dimension axes.");
 
 
     template<class ContiguousRange,
@@ -87,6 +75,38 @@ class bounding_box_hierarchy
     {}
 
 
+    // a copy refers to the same elements as other
+    bounding_box_hierarchy(const bounding_box_hierarchy& other)
+      : nodes_(other.nodes_)
+    {
+      relocate_nodes(other);
+    }
+
+
+    // a copy of other which refers to elements, rather than to the elements other refers to
+    // elements must hold copies of other's elements in the same order, e.g. a copy kept closer to the threads which query it
+    template<class ContiguousRange>
+    bounding_box_hierarchy(const bounding_box_hierarchy& other, const ContiguousRange& elements)
+      : nodes_(other.nodes_)
+    {
+      relocate_nodes(other, &*elements.begin());
+    }
+
+
+    bounding_box_hierarchy(bounding_box_hierarchy&&) = default;
+
+
+    bounding_box_hierarchy& operator=(const bounding_box_hierarchy& other)
+    {
+      nodes_ = other.nodes_;
+      relocate_nodes(other);
+      return *this;
+    }
+
+
+    bounding_box_hierarchy& operator=(bounding_box_hierarchy&&) = default;
+
+
     bounding_box_type bounding_box() const
     {
       return bounding_box(root_node());
@@ -95,26 +115,28 @@ class bounding_box_hierarchy
 
     template<class Point, class Vector, class U,
              class Function1 = call_member_intersect,
-             class Function2 = default_projection>
+             class Function2 = default_projection<Scalar>>
     U intersect(Point origin, Vector direction, U init,
                 Function1 intersector = call_member_intersect(),
-                Function2 hit_time = default_projection()) const
+                Function2 hit_time = default_projection<Scalar>()) const
     {
       U result = init;
       auto result_t = hit_time(result);
 
-      Vector one_over_direction = {1.f/direction[0], 1.f/direction[1], 1.f/direction[2]};
-      std::array<bool,3> is_negative{{std::signbit(direction[0]), std::signbit(direction[1]), std::signbit(direction[2])}};
-
-      using stack_type = short_stack<const node*,64>;
+      Vector one_over_direction;
+      std::array<bool,Dimension> is_negative;
+      for_each_axis<Dimension>([&](auto axis)
+      {
+        one_over_direction[axis] = Scalar(1) / direction[axis];
+        is_negative[axis] = std::signbit(direction[axis]);
+      });
 
-      stack_type stack;
+      growable_stack<const node*,64> stack;
       stack.push(root_node());
 
       while(!stack.empty())
       {
-        const node* current_node = stack.top();
-        stack.pop();
+        const node* current_node = stack.pop();
 
         if(is_leaf(current_node))
         {
@@ -144,99 +166,917 @@ class bounding_box_hierarchy
     }
 
 
-  private:
-    template<class U, size_t N>
-    class short_stack : private std::array<U,N>
+    // calls callback(element, result) for every element the ray hits before hit_time(init), in no particular order
+    // intersector is called with init as its nearest result, and a result nearer than init is a hit
+    // if callback returns false, the query stops early. returns false if the query was stopped early
+    template<class Point, class Vector, class U, class Function,
+             class Function1 = call_member_intersect,
+             class Function2 = default_projection<Scalar>>
+    bool for_each_intersection(Point origin, Vector direction, U init, Function callback,
+                               Function1 intersector = call_member_intersect(),
+                               Function2 hit_time = default_projection<Scalar>()) const
+    {
+      auto init_t = hit_time(init);
+
+      Vector one_over_direction;
+      std::array<bool,Dimension> is_negative;
+      for_each_axis<Dimension>([&](auto axis)
+      {
+        one_over_direction[axis] = Scalar(1) / direction[axis];
+        is_negative[axis] = std::signbit(direction[axis]);
+      });
+
+      growable_stack<const node*,64> stack;
+      stack.push(root_node());
+
+      while(!stack.empty())
+      {
+        const node* current_node = stack.pop();
+
+        if(is_leaf(current_node))
+        {
+          const T& e = element(current_node);
+          auto current_result = intersector(e, origin, direction, init);
+          if(hit_time(current_result) < init_t && !invoke_intersection_callback(callback, e, current_result, 0))
+          {
+            return false;
+          }
+        }
+        else
+        {
+          if(intersect_box(bounding_box(current_node), origin, one_over_direction, is_negative, init_t))
+          {
+            // push children to stack
+            stack.push(current_node->left_child_);
+            stack.push(current_node->right_child_);
+          }
+        }
+      }
+
+      return true;
+    }
+
+
+    // finds the nearest results_last - results_first hits along the ray before hit_time(init)
+    // writes them to results in order of increasing hit time, and returns the end of the hits written
+    // while results holds fewer hits than it has room for, intersector is called with init as its nearest result,
+    // and afterwards with the farthest hit in results, so subtrees beyond that hit are culled
+    template<class Point, class Vector, class U, class RandomAccessIterator,
+             class Function1 = call_member_intersect,
+             class Function2 = default_projection<Scalar>>
+    RandomAccessIterator intersect_nearest(Point origin, Vector direction, U init,
+                                           RandomAccessIterator results_first, RandomAccessIterator results_last,
+                                           Function1 intersector = call_member_intersect(),
+                                           Function2 hit_time = default_projection<Scalar>()) const
+    {
+      size_t max_num_hits = results_last - results_first;
+      if(max_num_hits == 0)
+      {
+        return results_first;
+      }
+
+      // results [results_first, heap_last) are a heap whose first result is the farthest
+      RandomAccessIterator heap_last = results_first;
+      auto is_nearer = [&](const U& a, const U& b)
+      {
+        return hit_time(a) < hit_time(b);
+      };
+
+      // the result that hits must be nearer than, and its hit time
+      U farthest = init;
+      auto farthest_t = hit_time(farthest);
+
+      Vector one_over_direction;
+      std::array<bool,Dimension> is_negative;
+      for_each_axis<Dimension>([&](auto axis)
+      {
+        one_over_direction[axis] = Scalar(1) / direction[axis];
+        is_negative[axis] = std::signbit(direction[axis]);
+      });
+
+      growable_stack<const node*,64> stack;
+      stack.push(root_node());
+
+      while(!stack.empty())
+      {
+        const node* current_node = stack.pop();
+
+        if(is_leaf(current_node))
+        {
+          U current_result = intersector(element(current_node), origin, direction, farthest);
+          if(hit_time(current_result) < farthest_t)
+          {
+            if(size_t(heap_last - results_first) == max_num_hits)
+            {
+              // replace the farthest hit
+              std::pop_heap(results_first, heap_last, is_nearer);
+              --heap_last;
+            }
+
+            *heap_last = current_result;
+            ++heap_last;
+            std::push_heap(results_first, heap_last, is_nearer);
+
+            if(size_t(heap_last - results_first) == max_num_hits)
+            {
+              farthest = *results_first;
+              farthest_t = hit_time(farthest);
+            }
+          }
+        }
+        else
+        {
+          if(intersect_box(bounding_box(current_node), origin, one_over_direction, is_negative, farthest_t))
+          {
+            // push children to stack
+            stack.push(current_node->left_child_);
+            stack.push(current_node->right_child_);
+          }
+        }
+      }
+
+      std::sort_heap(results_first, heap_last, is_nearer);
+
+      return heap_last;
+    }
+
+
+    // finds the first contact of a sphere of the given radius whose center moves from origin along direction
+    // like intersect(), but a node is visited only if its box, inflated by radius, is hit by the center's path
+    // intersector(element, origin, direction, radius, result) returns the contact of the moving sphere with element,
+    // and by default calls element.intersect(origin, direction, radius, result)
+    // radius may bound any shape around the center, e.g. a capsule, so long as intersector tests the shape exactly
+    template<class Point, class Vector, class U,
+             class Function1 = call_member_intersect,
+             class Function2 = default_projection<Scalar>>
+    U sphere_cast(Point origin, Vector direction, Scalar radius, U init,
+                  Function1 intersector = call_member_intersect(),
+                  Function2 hit_time = default_projection<Scalar>()) const
+    {
+      U result = init;
+      auto result_t = hit_time(result);
+
+      Vector one_over_direction;
+      std::array<bool,Dimension> is_negative;
+      for_each_axis<Dimension>([&](auto axis)
+      {
+        one_over_direction[axis] = Scalar(1) / direction[axis];
+        is_negative[axis] = std::signbit(direction[axis]);
+      });
+
+      growable_stack<const node*,64> stack;
+      stack.push(root_node());
+
+      while(!stack.empty())
+      {
+        const node* current_node = stack.pop();
+
+        if(is_leaf(current_node))
+        {
+          auto current_result = intersector(element(current_node), origin, direction, radius, result);
+          auto current_t = hit_time(current_result);
+          if(current_t < result_t)
+          {
+            result_t = current_t;
+            result = current_result;
+          }
+        }
+        else
+        {
+          if(intersect_box(inflate(bounding_box(current_node), radius), origin, one_over_direction, is_negative, result_t))
+          {
+            // push children to stack
+            stack.push(current_node->left_child_);
+            stack.push(current_node->right_child_);
+          }
+        }
+      }
+
+      return result;
+    }
+
+
+    // calls callback(element) for each element whose bounding box overlaps region
+    // region is a bounding box, or any type for which overlaps(region, box) tests overlap with a bounding box
+    // by default, overlaps calls region.overlaps(box) if it exists
+    // if callback returns false, the query stops early. returns false if the query was stopped early
+    // elements are tested against the bounding boxes given by bounder, which should return the same boxes as
+    // the bounder the hierarchy was built with: nodes only enclose those boxes, so larger ones may be missed
+    template<class Region, class Function,
+             class OverlapTest = call_member_overlaps,
+             class Bounder = call_member_bounding_box>
+    bool query_overlaps(const Region& region, Function callback,
+                        OverlapTest overlaps = call_member_overlaps(),
+                        Bounder bounder = call_member_bounding_box()) const
+    {
+      if(!overlaps(region, bounding_box()))
+      {
+        return true;
+      }
+
+      growable_stack<const node*,64> stack;
+      stack.push(root_node());
+
+      while(!stack.empty())
+      {
+        const node* current_node = stack.pop();
+
+        if(is_leaf(current_node))
+        {
+          const T& e = element(current_node);
+          if(overlaps(region, bounder(e)) && !invoke_callback(callback, e, 0))
+          {
+            return false;
+          }
+        }
+        else
+        {
+          // push the children whose boxes overlap the region
+          // leaves have no boxes of their own, so they are tested when popped
+          for(const node* child : {current_node->left_child_, current_node->right_child_})
+          {
+            if(is_leaf(child) || overlaps(region, bounding_box(child)))
+            {
+              stack.push(child);
+            }
+          }
+        }
+      }
+
+      return true;
+    }
+
+
+    // calls callback(a, b) for each pair of an element a of this hierarchy and an element b of other whose bounding boxes overlap
+    // both hierarchies are traversed simultaneously, and the work is split among num_threads threads by
+    // dividing the pairs of top-level nodes. when num_threads > 1, callback and the bounders must be safe to call concurrently
+    // bounder and other_bounder bound the elements of each hierarchy, as for query_overlaps()
+    template<class U, class OtherAllocator, class Function,
+             class Bounder = call_member_bounding_box,
+             class OtherBounder = call_member_bounding_box>
+    void for_each_overlapping_pair(const bounding_box_hierarchy<U,Dimension,Scalar,OtherAllocator>& other,
+                                   Function callback,
+                                   size_t num_threads = 1,
+                                   Bounder bounder = call_member_bounding_box(),
+                                   OtherBounder other_bounder = call_member_bounding_box()) const
+    {
+      std::vector<overlap_task> tasks{overlap_task{root_node(), other.root_node(), false}};
+
+      for_each_overlapping_pair_in_tasks(*this, other, tasks, callback, num_threads, bounder, other_bounder);
+    }
+
+
+    // calls callback(a, b) for each pair of distinct elements a and b of this hierarchy whose bounding boxes overlap
+    // each pair is reported once, in no particular order
+    // when num_threads > 1, callback and bounder must be safe to call concurrently
+    template<class Function, class Bounder = call_member_bounding_box>
+    void for_each_overlapping_pair(Function callback,
+                                   size_t num_threads = 1,
+                                   Bounder bounder = call_member_bounding_box()) const
+    {
+      std::vector<overlap_task> tasks{overlap_task{root_node(), root_node(), true}};
+
+      for_each_overlapping_pair_in_tasks(*this, *this, tasks, callback, num_threads, bounder, bounder);
+    }
+
+
+    // intersects a tile of rays sharing a common origin, e.g. the primary rays of an 8x8 block of pixels
+    // the hierarchy is traversed once for the whole tile: subtrees outside of the tile's bounding beam are
+    // culled without testing individual rays, and per-ray tests only happen below nodes the beam touches
+    // writes the nearest intersection of each ray to results and returns the end of the results range
+    template<class Point, class RandomAccessIterator, class OutputIterator, class U,
+             class Function1 = call_member_intersect,
+             class Function2 = default_projection<Scalar>>
+    OutputIterator intersect_tile(Point origin,
+                                  RandomAccessIterator directions_first, RandomAccessIterator directions_last,
+                                  OutputIterator results_first,
+                                  U init,
+                                  Function1 intersector = call_member_intersect(),
+                                  Function2 hit_time = default_projection<Scalar>()) const
+    {
+      using vector_type = typename std::iterator_traits<RandomAccessIterator>::value_type;
+      using time_type = decltype(hit_time(init));
+
+      size_t num_rays = directions_last - directions_first;
+
+      std::vector<U> results(num_rays, init);
+      std::vector<time_type> results_t(num_rays, hit_time(init));
+      std::vector<vector_type> one_over_directions(num_rays);
+      std::vector<std::array<bool,Dimension>> is_negative(num_rays);
+
+      for(size_t i = 0; i < num_rays; ++i)
+      {
+        const vector_type& direction = directions_first[i];
+        for_each_axis<Dimension>([&](auto axis)
+        {
+          one_over_directions[i][axis] = Scalar(1) / direction[axis];
+          is_negative[i][axis] = std::signbit(direction[axis]);
+        });
+      }
+
+      beam tile_beam(one_over_directions, is_negative);
+
+      // the beam is culled against the furthest result of the tile. results only ever get nearer, so max_result_t is
+      // only recomputed when the last of the num_rays_at_max rays whose result is that far finds a nearer one
+      time_type max_result_t = hit_time(init);
+      size_t num_rays_at_max = num_rays;
+
+      // the rays which hit the box of the node whose leaf children are being intersected
+      std::vector<size_t> active_rays;
+      active_rays.reserve(num_rays);
+
+      auto intersect_leaf = [&](const node* leaf)
+      {
+        for(size_t i : active_rays)
+        {
+          auto current_result = intersector(element(leaf), origin, directions_first[i], results[i]);
+          auto current_t = hit_time(current_result);
+          if(current_t < results_t[i])
+          {
+            if(!(results_t[i] < max_result_t))
+            {
+              --num_rays_at_max;
+            }
+
+            results_t[i] = current_t;
+            results[i] = current_result;
+          }
+        }
+
+        if(num_rays_at_max == 0)
+        {
+          max_result_t = *std::max_element(results_t.begin(), results_t.end());
+          num_rays_at_max = std::count(results_t.begin(), results_t.end(), max_result_t);
+        }
+      };
+
+      // each stack entry carries the index of the first ray of the tile which may still hit the entry's node
+      // leaves are never pushed, so every entry is an interior node
+      growable_stack<std::pair<const node*,size_t>,64> stack;
+      stack.push(std::make_pair(root_node(), size_t(0)));
+
+      while(!stack.empty())
+      {
+        std::pair<const node*,size_t> entry = stack.pop();
+        const node* current_node = entry.first;
+        size_t first_active_ray = entry.second;
+
+        const bounding_box_type& box = bounding_box(current_node);
+
+        // cull the subtree if no ray of the tile can hit the box
+        if(!tile_beam.intersect_box(box, origin, max_result_t))
+        {
+          continue;
+        }
+
+        // find the first ray which actually hits the box
+        while(first_active_ray < num_rays &&
+              !intersect_box(box, origin, one_over_directions[first_active_ray], is_negative[first_active_ray], results_t[first_active_ray]))
+        {
+          ++first_active_ray;
+        }
+
+        if(first_active_ray == num_rays)
+        {
+          continue;
+        }
+
+        const node* left_child = current_node->left_child_;
+        const node* right_child = current_node->right_child_;
+
+        if(is_leaf(left_child) || is_leaf(right_child))
+        {
+          // leaves have no boxes of their own, so intersect them now, while the rays which hit their parent's box are known
+          active_rays.assign(1, first_active_ray);
+          for(size_t i = first_active_ray + 1; i < num_rays; ++i)
+          {
+            if(intersect_box(box, origin, one_over_directions[i], is_negative[i], results_t[i]))
+            {
+              active_rays.push_back(i);
+            }
+          }
+
+          for(const node* child : {left_child, right_child})
+          {
+            if(is_leaf(child))
+            {
+              intersect_leaf(child);
+            }
+          }
+        }
+
+        // push interior children to stack
+        for(const node* child : {left_child, right_child})
+        {
+          if(!is_leaf(child))
+          {
+            stack.push(std::make_pair(child, first_active_ray));
+          }
+        }
+      }
+
+      return std::copy(results.begin(), results.end(), results_first);
+    }
+
+
+    // intersects a batch of rays with unrelated origins and directions, e.g. diffuse secondary rays
+    // tracing such rays in the order they arrive visits unrelated subtrees in turn, so the rays are first sorted
+    // by the octant of their direction and the position of their origin along a Morton curve, and traced in sorted order
+    // with intersect_interleaved(). the work is split among num_threads threads. intersector and hit_time must be safe to call concurrently
+    // writes the nearest intersection of each ray to its own position in results and returns the end of the results range
+    template<class RandomAccessIterator1, class RandomAccessIterator2, class RandomAccessIterator3, class U,
+             class Function1 = call_member_intersect,
+             class Function2 = default_projection<Scalar>>
+    RandomAccessIterator3 intersect_rays(RandomAccessIterator1 origins_first, RandomAccessIterator1 origins_last,
+                                         RandomAccessIterator2 directions_first,
+                                         RandomAccessIterator3 results_first,
+                                         U init,
+                                         size_t num_threads = 1,
+                                         Function1 intersector = call_member_intersect(),
+                                         Function2 hit_time = default_projection<Scalar>()) const
     {
-      public:
-        short_stack()
-          : top_(this->data())
-        {}
+      size_t num_rays = origins_last - origins_first;
+
+      // sort the rays' indices by their keys
+      bounding_box_type box = bounding_box();
+      std::vector<std::pair<std::uint64_t,size_t>> order(num_rays);
+      for(size_t i = 0; i < num_rays; ++i)
+      {
+        order[i] = std::make_pair(ray_key(box, origins_first[i], directions_first[i]), i);
+      }
 
-        void push(const U& value)
+      std::sort(order.begin(), order.end());
+
+      // each thread claims consecutive runs of sorted rays in turn and scatters their results back to the rays' positions
+      size_t num_rays_per_task = 256;
+      std::atomic<size_t> next_ray{0};
+      auto worker = [&]
+      {
+        for(size_t begin = next_ray.fetch_add(num_rays_per_task); begin < num_rays; begin = next_ray.fetch_add(num_rays_per_task))
         {
-          ++top_;
-          *top_ = value;
+          size_t end = std::min(begin + num_rays_per_task, num_rays);
+          intersect_interleaved(end - begin, [&](size_t j) { return order[begin + j].second; },
+                                origins_first, directions_first, results_first,
+                                init, intersector, hit_time);
         }
+      };
+
+      std::vector<std::thread> threads;
+      for(size_t i = 1; i < num_threads; ++i)
+      {
+        threads.emplace_back(worker);
+      }
+
+      worker();
+
+      for(auto& thread : threads)
+      {
+        thread.join();
+      }
+
+      return results_first + num_rays;
+    }
+
+
+    // intersects a batch of rays in the given order, like calling intersect() for each ray, but faster when the
+    // hierarchy is too large for the cache. several rays are traced at once: after each step of a ray's traversal,
+    // the nodes it will visit next are prefetched, and the next ray takes a step while they load
+    // writes the nearest intersection of each ray to its own position in results and returns the end of the results range
+    template<class RandomAccessIterator1, class RandomAccessIterator2, class RandomAccessIterator3, class U,
+             class Function1 = call_member_intersect,
+             class Function2 = default_projection<Scalar>>
+    RandomAccessIterator3 intersect_interleaved(RandomAccessIterator1 origins_first, RandomAccessIterator1 origins_last,
+                                                RandomAccessIterator2 directions_first,
+                                                RandomAccessIterator3 results_first,
+                                                U init,
+                                                Function1 intersector = call_member_intersect(),
+                                                Function2 hit_time = default_projection<Scalar>()) const
+    {
+      size_t num_rays = origins_last - origins_first;
 
-        U&& pop()
+      intersect_interleaved(num_rays, [](size_t j) { return j; },
+                            origins_first, directions_first, results_first,
+                            init, intersector, hit_time);
+
+      return results_first + num_rays;
+    }
+
+
+  private:
+    template<class, size_t, class, class> friend class bounding_box_hierarchy;
+
+    struct node;
+
+    using node_vector = std::vector<node, typename std::allocator_traits<Allocator>::template rebind_alloc<node>>;
+
+
+    // a pair of nodes whose subtrees' overlapping elements are yet to be found
+    // if is_self is true, a and b are the same node, and the task finds the overlapping pairs within its subtree
+    struct overlap_task
+    {
+      const node* a;
+      const void* b;
+      bool is_self;
+    };
+
+
+    // leaves keep no boxes, so a leaf's box is found with bounder
+    template<class Bounder>
+    bounding_box_type bounding_box_of_child(const node* n, Bounder& bounder) const
+    {
+      return is_leaf(n) ? bounding_box_type(bounder(element(n))) : bounding_box(n);
+    }
+
+
+    static bool overlaps(const bounding_box_type& a, const bounding_box_type& b)
+    {
+      bool result = true;
+      for_each_axis<Dimension>([&](auto axis)
+      {
+        result &= (a[0][axis] <= b[1][axis]) & (b[0][axis] <= a[1][axis]);
+      });
+
+      return result;
+    }
+
+
+    // splits task into smaller tasks, or reports a pair of overlapping elements
+    // a pair of subtrees is split by descending into the children of the larger subtree
+    template<class Other, class Function, class Bounder, class OtherBounder, class OutputFunction>
+    static void split_overlap_task(const bounding_box_hierarchy& self, const Other& other,
+                                   const overlap_task& task,
+                                   Function& callback,
+                                   Bounder& bounder,
+                                   OtherBounder& other_bounder,
+                                   OutputFunction push)
+    {
+      using other_node = typename Other::node;
+
+      if(task.is_self)
+      {
+        if(!self.is_leaf(task.a))
         {
-          return std::move(*top_--);
+          push(overlap_task{task.a->left_child_,  task.a->left_child_,  true});
+          push(overlap_task{task.a->right_child_, task.a->right_child_, true});
+          push(overlap_task{task.a->left_child_,  task.a->right_child_, false});
         }
 
-        bool empty() const
+        return;
+      }
+
+      const node* a = task.a;
+      const other_node* b = static_cast<const other_node*>(task.b);
+
+      bounding_box_type a_box = self.bounding_box_of_child(a, bounder);
+      bounding_box_type b_box = other.bounding_box_of_child(b, other_bounder);
+
+      if(!overlaps(a_box, b_box))
+      {
+        return;
+      }
+
+      bool a_is_leaf = self.is_leaf(a);
+      bool b_is_leaf = other.is_leaf(b);
+
+      if(a_is_leaf && b_is_leaf)
+      {
+        callback(self.element(a), other.element(b));
+      }
+      else if(b_is_leaf || (!a_is_leaf && minimize_surface_area_heuristic::surface_area(a_box) >= minimize_surface_area_heuristic::surface_area(b_box)))
+      {
+        push(overlap_task{a->left_child_,  b, false});
+        push(overlap_task{a->right_child_, b, false});
+      }
+      else
+      {
+        push(overlap_task{a, b->left_child_,  false});
+        push(overlap_task{a, b->right_child_, false});
+      }
+    }
+
+
+    template<class Other, class Function, class Bounder, class OtherBounder>
+    static void for_each_overlapping_pair_in_tasks(const bounding_box_hierarchy& self, const Other& other,
+                                                   std::vector<overlap_task>& tasks,
+                                                   Function& callback,
+                                                   size_t num_threads,
+                                                   Bounder& bounder,
+                                                   OtherBounder& other_bounder)
+    {
+      num_threads = std::max<size_t>(num_threads, 1);
+
+      // split the top-level tasks breadth first until there are enough to balance among the threads
+      size_t num_tasks_per_thread = 16;
+      if(num_threads > 1)
+      {
+        std::vector<overlap_task> next_tasks;
+        while(!tasks.empty() && tasks.size() < num_threads * num_tasks_per_thread)
         {
-          return top_ == this->data();
+          next_tasks.clear();
+          for(const overlap_task& task : tasks)
+          {
+            split_overlap_task(self, other, task, callback, bounder, other_bounder, [&](const overlap_task& t)
+            {
+              next_tasks.push_back(t);
+            });
+          }
+
+          tasks.swap(next_tasks);
         }
+      }
+
+      // each thread claims tasks in turn and finishes them depth first
+      std::atomic<size_t> next_task{0};
+      auto worker = [&]
+      {
+        std::vector<overlap_task> stack;
 
-        U& top()
+        for(size_t i = next_task++; i < tasks.size(); i = next_task++)
         {
-          return *top_;
+          stack.push_back(tasks[i]);
+
+          while(!stack.empty())
+          {
+            overlap_task task = stack.back();
+            stack.pop_back();
+
+            split_overlap_task(self, other, task, callback, bounder, other_bounder, [&](const overlap_task& t)
+            {
+              stack.push_back(t);
+            });
+          }
         }
+      };
+
+      std::vector<std::thread> threads;
+      for(size_t i = 1; i < num_threads; ++i)
+      {
+        threads.emplace_back(worker);
+      }
+
+      worker();
 
-        const U& top() const
+      for(auto& thread : threads)
+      {
+        thread.join();
+      }
+    }
+
+
+    // a beam bounds a tile of rays with a common origin using interval arithmetic over the rays' reciprocal directions
+    struct beam
+    {
+      template<class Vector>
+      beam(const std::vector<Vector>& one_over_directions, const std::vector<std::array<bool,Dimension>>& is_negative)
+      {
+        for(size_t axis = 0; axis < Dimension; ++axis)
         {
-          return *top_;
+          min_one_over_direction_[axis] = std::numeric_limits<Scalar>::infinity();
+          max_one_over_direction_[axis] = -std::numeric_limits<Scalar>::infinity();
+          is_bounded_[axis] = !one_over_directions.empty();
+          is_negative_[axis] = !is_negative.empty() && is_negative[0][axis];
+
+          for(size_t i = 0; i < one_over_directions.size(); ++i)
+          {
+            Scalar x = one_over_directions[i][axis];
+
+            // the beam cannot bound this axis if its rays disagree in sign or are parallel to the axis' slabs
+            if(is_negative[i][axis] != is_negative_[axis] || std::isinf(x))
+            {
+              is_bounded_[axis] = false;
+            }
+
+            min_one_over_direction_[axis] = std::min(min_one_over_direction_[axis], x);
+            max_one_over_direction_[axis] = std::max(max_one_over_direction_[axis], x);
+          }
         }
+      }
+
+      // returns false only if no ray of the beam can hit the box before t_bound
+      template<class Point>
+      bool intersect_box(const bounding_box_type& box, Point origin, Scalar t_bound) const
+      {
+        Scalar tmin = -std::numeric_limits<Scalar>::infinity();
+        Scalar tmax =  std::numeric_limits<Scalar>::infinity();
+
+        for_each_axis<Dimension>([&](auto axis)
+        {
+          if(is_bounded_[axis])
+          {
+            Scalar near_distance = box[is_negative_[axis]][axis] - origin[axis];
+            Scalar far_distance  = box[1 - is_negative_[axis]][axis] - origin[axis];
+
+            // the earliest entry and the latest exit of any ray in the beam through this axis' slab
+            Scalar near_t = std::min(near_distance * min_one_over_direction_[axis], near_distance * max_one_over_direction_[axis]);
+            Scalar far_t  = std::max(far_distance  * min_one_over_direction_[axis], far_distance  * max_one_over_direction_[axis]);
+
+            tmin = std::max(tmin, near_t);
+            tmax = std::min(tmax, far_t);
+          }
+        });
 
-      private:
-        U* top_;
+        return tmin <= tmax && tmin < t_bound && tmax >= Scalar(0);
+      }
+
+      std::array<Scalar,Dimension> min_one_over_direction_;
+      std::array<Scalar,Dimension> max_one_over_direction_;
+      std::array<bool,Dimension> is_bounded_;
+      std::array<bool,Dimension> is_negative_;
     };
 
+
+    // the box grown by radius in every direction, which contains every point within radius of the box
+    static bounding_box_type inflate(const bounding_box_type& box, Scalar radius)
+    {
+      bounding_box_type result = box;
+      for_each_axis<Dimension>([&](auto axis)
+      {
+        result[0][axis] -= radius;
+        result[1][axis] += radius;
+      });
+
+      return result;
+    }
+
+
+    // the key of a ray is the octant of its direction followed by the Morton code of its origin quantized within box
+    // rays with nearby keys start near each other and point the same way
     template<class Point, class Vector>
-    static bool intersect_box(const bounding_box_type& box,
-                              Point origin,
-                              Vector one_over_direction,
-                              const std::array<bool,3>& is_negative,
-                              float t_bound)
+    static std::uint64_t ray_key(const bounding_box_type& box, const Point& origin, const Vector& direction)
     {
-      float tmin = (box[is_negative[0]][0] - origin[0]) * one_over_direction[0];
-      float tmax = (box[1 - is_negative[0]][0] - origin[0]) * one_over_direction[0];
+      constexpr size_t num_bits_per_axis = std::min<size_t>((64 - Dimension) / Dimension, 21);
+      constexpr std::uint64_t num_cells_per_axis = std::uint64_t(1) << num_bits_per_axis;
 
-      float tymin = (box[is_negative[1]][1] - origin[1]) * one_over_direction[1];
-      float tymax = (box[1 - is_negative[1]][1] - origin[1]) * one_over_direction[1];
+      std::uint64_t octant = 0;
+      std::array<std::uint64_t,Dimension> cell;
 
-      if(tmin > tymax || tymin > tmax)
+      for_each_axis<Dimension>([&](auto axis)
       {
-        return false;
-      }
+        octant = (octant << 1) | std::uint64_t(std::signbit(direction[axis]));
 
-      if(tymin > tmin) tmin = tymin;
-      if(tymax < tmax) tmax = tymax;
+        // origins outside of the box are clamped to its boundary
+        Scalar x = (origin[axis] - box[0][axis]) / (box[1][axis] - box[0][axis]);
+        if(!(x > Scalar(0))) x = Scalar(0);
+        if(x > Scalar(1)) x = Scalar(1);
 
-      float tzmin = (box[is_negative[2]][2] - origin[2]) * one_over_direction[2];
-      float tzmax = (box[1 - is_negative[2]][2] - origin[2]) * one_over_direction[2];
+        cell[axis] = std::min(std::uint64_t(x * Scalar(num_cells_per_axis)), num_cells_per_axis - 1);
+      });
 
-      if(tmin > tzmax || tzmin > tmax)
+      // interleave the bits of the cells' coordinates, most significant first
+      std::uint64_t morton_code = 0;
+      for(size_t bit = num_bits_per_axis; bit-- > 0;)
       {
-        return false;
+        for(size_t axis = 0; axis < Dimension; ++axis)
+        {
+          morton_code = (morton_code << 1) | ((cell[axis] >> bit) & 1);
+        }
       }
 
-      if(tzmin > tmin) tmin = tzmin;
-      if(tzmax < tmax) tmax = tzmax;
+      return (octant << (num_bits_per_axis * Dimension)) | morton_code;
+    }
+
 
-      return tmin < t_bound && tmax >= 0.f;
+    static void prefetch(const void* address)
+    {
+#if defined(__GNUC__) || defined(__clang__)
+      __builtin_prefetch(address);
+#else
+      (void)address;
+#endif
     }
 
 
-    template<class IndirectBounder>
-    static bounding_box_type bounding_box(const std::vector<size_t>::iterator begin,
-                                          const std::vector<size_t>::iterator end,
-                                          IndirectBounder bounder)
+    // the traversal state of one of the rays that intersect_interleaved() keeps in flight
+    // result is constructed from init, so that U need not be default constructible
+    template<class Point, class Vector, class U, class Time>
+    struct ray_in_flight
+    {
+      explicit ray_in_flight(const U& init)
+        : result(init)
+      {}
+
+      size_t index;
+      Point origin;
+      Vector direction;
+      Vector one_over_direction;
+      std::array<bool,Dimension> is_negative;
+      U result;
+      Time result_t;
+      growable_stack<const node*,64> stack;
+    };
+
+
+    // intersects rays index_of(0), index_of(1), ... index_of(num_rays - 1)
+    // each ray_in_flight takes one step of its traversal in turn, so that the loads of the nodes prefetched by one ray
+    // overlap with the steps of the others
+    template<class IndexFunction, class RandomAccessIterator1, class RandomAccessIterator2, class RandomAccessIterator3, class U,
+             class Function1, class Function2>
+    void intersect_interleaved(size_t num_rays, IndexFunction index_of,
+                               RandomAccessIterator1 origins_first,
+                               RandomAccessIterator2 directions_first,
+                               RandomAccessIterator3 results_first,
+                               U init,
+                               Function1 intersector,
+                               Function2 hit_time) const
     {
-      float inf = std::numeric_limits<float>::infinity();
-      bounding_box_type result{{{inf, inf, inf}, {-inf, -inf, -inf}}};
-          
-      for(std::vector<size_t>::iterator e = begin; e != end; ++e)
+      using point_type = typename std::iterator_traits<RandomAccessIterator1>::value_type;
+      using vector_type = typename std::iterator_traits<RandomAccessIterator2>::value_type;
+      using time_type = decltype(hit_time(init));
+
+      constexpr size_t num_rays_in_flight = 8;
+      std::vector<ray_in_flight<point_type,vector_type,U,time_type>> rays;
+      rays.reserve(num_rays_in_flight);
+      for(size_t k = 0; k < num_rays_in_flight; ++k)
       {
-        auto bounding_box = bounder(*e);
+        rays.emplace_back(init);
+      }
+      std::array<bool,num_rays_in_flight> is_active{};
 
-        for(int i = 0; i < 3; ++i)
+      size_t next_ray = 0;
+      auto start_next_ray = [&](ray_in_flight<point_type,vector_type,U,time_type>& ray)
+      {
+        if(next_ray == num_rays)
+        {
+          return false;
+        }
+
+        ray.index = index_of(next_ray++);
+        ray.origin = origins_first[ray.index];
+        ray.direction = directions_first[ray.index];
+        for_each_axis<Dimension>([&](auto axis)
+        {
+          ray.one_over_direction[axis] = Scalar(1) / ray.direction[axis];
+          ray.is_negative[axis] = std::signbit(ray.direction[axis]);
+        });
+        ray.result = init;
+        ray.result_t = hit_time(init);
+        ray.stack.push(root_node());
+
+        return true;
+      };
+
+      size_t num_active = 0;
+      for(size_t k = 0; k < num_rays_in_flight; ++k)
+      {
+        is_active[k] = start_next_ray(rays[k]);
+        num_active += is_active[k];
+      }
+
+      while(num_active > 0)
+      {
+        for(size_t k = 0; k < num_rays_in_flight; ++k)
         {
-          result[0][i] = std::min(result[0][i], bounding_box[0][i]);
-          result[1][i] = std::max(result[1][i], bounding_box[1][i]);
+          if(!is_active[k]) continue;
+
+          auto& ray = rays[k];
+
+          const node* current_node = ray.stack.pop();
+
+          if(is_leaf(current_node))
+          {
+            auto current_result = intersector(element(current_node), ray.origin, ray.direction, ray.result);
+            auto current_t = hit_time(current_result);
+            if(current_t < ray.result_t)
+            {
+              ray.result_t = current_t;
+              ray.result = current_result;
+            }
+          }
+          else if(intersect_box(bounding_box(current_node), ray.origin, ray.one_over_direction, ray.is_negative, ray.result_t))
+          {
+            // push children to stack and fetch them while the other rays take their steps
+            ray.stack.push(current_node->left_child_);
+            ray.stack.push(current_node->right_child_);
+            prefetch(current_node->left_child_);
+            prefetch(current_node->right_child_);
+          }
+
+          if(ray.stack.empty())
+          {
+            results_first[ray.index] = ray.result;
+
+            is_active[k] = start_next_ray(ray);
+            num_active -= !is_active[k];
+          }
         }
       }
+    }
+
+    template<class Iterator>
+    static bounding_box_type bounding_box(Iterator begin, Iterator end)
+    {
+      bounding_box_type result = minimize_surface_area_heuristic::empty_box<bounding_box_type>();
+
+      for(Iterator ref = begin; ref != end; ++ref)
+      {
+        const bounding_box_type& bounding_box = ref->bounding_box_;
+
+        for_each_axis<Dimension>([&](auto axis)
+        {
+          result[0][axis] = std::min(result[0][axis], bounding_box[0][axis]);
+          result[1][axis] = std::max(result[1][axis], bounding_box[1][axis]);
+        });
+      }
 
       return result;
     }
@@ -257,54 +1097,31 @@ class bounding_box_hierarchy
       {}
     };
 
-    template<class Bounder>
-    struct indirect_bounder
-    {
-      template<class ContiguousRange>
-      indirect_bounder(Bounder bounder_, const ContiguousRange& elements)
-        : bounder(bounder_),
-          data(&*elements.begin())
-      {}
-
-      auto operator()(size_t element_idx) const
-      {
-        return bounder(data[element_idx]);
-      }
-
-      Bounder bounder;
-      const T* data;
-    };
-
-    template<class Bounder, class ContiguousRange>
-    static indirect_bounder<Bounder> make_indirect_bounder(Bounder bounder, const ContiguousRange& elements)
-    {
-      return indirect_bounder<Bounder>(bounder, elements);
-    }
+    using primitive_reference = ::primitive_reference<bounding_box_type>;
 
 
-    template<class ContiguousRange, class IndirectBounder, class Partitioner>
-    static const node* make_tree_recursive(std::vector<node>& tree,
-                                           std::vector<size_t>::iterator begin,
-                                           std::vector<size_t>::iterator end,
+    template<class ContiguousRange, class Partitioner>
+    static const node* make_tree_recursive(node_vector& tree,
+                                           typename std::vector<primitive_reference>::iterator begin,
+                                           typename std::vector<primitive_reference>::iterator end,
                                            const ContiguousRange& elements,
-                                           IndirectBounder bounder,
                                            Partitioner partitioner)
     {
       if(begin + 1 == end)
       {
         // we've hit a leaf, so return a pointer to the element
-        return reinterpret_cast<const node*>(&elements[*begin]);
+        return reinterpret_cast<const node*>(&elements[begin->index_]);
       }
 
       // find the bounding box of the elements
-      bounding_box_type box = bounding_box(begin, end, bounder);
+      bounding_box_type box = bounding_box(begin, end);
 
       // partition the elements into two sets
-      std::vector<size_t>::iterator split = partitioner(begin, end, box, bounder);
+      auto split = partitioner(begin, end, box, reference_bounder());
 
       // build subtrees
-      const node* left_child  = make_tree_recursive(tree, begin, split, elements, bounder, partitioner);
-      const node* right_child = make_tree_recursive(tree, split, end,   elements, bounder, partitioner);
+      const node* left_child  = make_tree_recursive(tree, begin, split, elements, partitioner);
+      const node* right_child = make_tree_recursive(tree, split, end,   elements, partitioner);
 
       // create a new node
       tree.emplace_back(left_child, right_child, box);
@@ -313,29 +1130,69 @@ class bounding_box_hierarchy
 
 
     template<class ContiguousRange, class Bounder, class Partitioner>
-    static std::vector<node> make_tree(const ContiguousRange& elements, Bounder bounder, Partitioner partitioner)
+    static node_vector make_tree(const ContiguousRange& elements, Bounder bounder, Partitioner partitioner)
     {
-      // we will sort an array of indices
-      std::vector<size_t> indices(elements.size());
-      std::iota(indices.begin(), indices.end(), 0);
+      // we will partition an array of references to the elements
+      std::vector<primitive_reference> references(elements.size());
+      for(size_t i = 0; i < references.size(); ++i)
+      {
+        primitive_reference& ref = references[i];
+        ref.bounding_box_ = bounder(elements[i]);
+        ref.centroid_ = partition_largest_axis_at_middle_element::centroid(ref.bounding_box_);
+        ref.index_ = i;
+      }
 
       // reserve n - 1 nodes to ensure that no iterators are invalidated during construction
-      std::vector<node> tree;
+      node_vector tree;
       tree.reserve(elements.size() - 1);
 
-      // memoize the bound function
-      memoized_bounder<T,Bounder> memoized_bounder(elements, bounder);
-
-      // add indirection to the bound function
-      auto indirect_bounder = make_indirect_bounder(std::ref(memoized_bounder), elements);
-
       // recurse
-      make_tree_recursive(tree, indices.begin(), indices.end(), elements, indirect_bounder, partitioner);
+      make_tree_recursive(tree, references.begin(), references.end(), elements, partitioner);
 
       return tree;
     }
 
 
+    // after copying other's nodes, points each node's interior children at this hierarchy's nodes instead of other's
+    // if elements is not null, also points each leaf at the element of elements with the same index
+    void relocate_nodes(const bounding_box_hierarchy& other, const T* elements = nullptr)
+    {
+      // every element is a leaf, so the first of other's elements is its leaf with the lowest address
+      const T* other_elements = nullptr;
+      if(elements)
+      {
+        std::less<const T*> less;
+        for(const node& n : other.nodes_)
+        {
+          for(const node* child : {n.left_child_, n.right_child_})
+          {
+            const T* e = reinterpret_cast<const T*>(child);
+            if(other.is_leaf(child) && (!other_elements || less(e, other_elements)))
+            {
+              other_elements = e;
+            }
+          }
+        }
+      }
+
+      auto relocate = [&](const node* child) -> const node*
+      {
+        if(other.is_leaf(child))
+        {
+          return elements ? reinterpret_cast<const node*>(elements + (reinterpret_cast<const T*>(child) - other_elements)) : child;
+        }
+
+        return nodes_.data() + (child - other.nodes_.data());
+      };
+
+      for(node& n : nodes_)
+      {
+        n.left_child_ = relocate(n.left_child_);
+        n.right_child_ = relocate(n.right_child_);
+      }
+    }
+
+
     const T& element(const node* leaf) const
     {
       return *reinterpret_cast<const T*>(leaf);
@@ -356,6 +1213,6 @@ class bounding_box_hierarchy
       return &nodes_.back();
     }
 
-    std::vector<node> nodes_;
+    node_vector nodes_;
 };
 
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+
+// describes the dimension and scalar type of a bounding box type
+// a bounding box is an array of two points, and a point is an array of Dimension Scalars
+// bounding box types whose points are not std::arrays may specialize bounding_box_traits
+template<class BoundingBox>
+struct bounding_box_traits
+{
+  using point_type = std::decay_t<decltype(std::declval<const BoundingBox&>()[0])>;
+
+  using scalar_type = std::decay_t<decltype(std::declval<const point_type&>()[0])>;
+
+  static constexpr std::size_t dimension = std::tuple_size<point_type>::value;
+};
+
+
+// describes the bounding box of an element type T
+// if T::bounding_box() exists, its result describes T's bounding box
+// otherwise, a bounding box is an array of two arrays of three floats
+template<class T>
+struct element_bounding_box_traits
+{
+  private:
+    template<class U>
+    static auto test(int) -> decltype(std::declval<U>().bounding_box());
+
+    template<class>
+    static std::array<std::array<float,3>,2> test(...);
+
+    using traits = bounding_box_traits<decltype(test<T>(0))>;
+
+  public:
+    static constexpr std::size_t dimension = traits::dimension;
+
+    using scalar_type = typename traits::scalar_type;
+};
+
+
+template<std::size_t... Axes, class Function>
+inline void for_each_axis_impl(std::index_sequence<Axes...>, Function&& f)
+{
+  // the elements of a braced initializer list are evaluated in order
+  int ignored[] = {0, (f(std::integral_constant<std::size_t,Axes>()), 0)...};
+  (void)ignored;
+}
+
+
+// calls f(axis) for each axis in [0, Dimension)
+// the loop is unrolled at compile time, and axis is a std::integral_constant
+template<std::size_t Dimension, class Function>
+inline void for_each_axis(Function&& f)
+{
+  for_each_axis_impl(std::make_index_sequence<Dimension>(), f);
+}
+
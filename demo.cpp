@@ -5,9 +5,26 @@
 #include <numeric>
 #include <iostream>
 #include <cassert>
+#include <cstdio>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <cmath>
+#include <cstdint>
+#include <utility>
 
+#include "adaptive_searcher.hpp"
+#include "blocked_exhaustive_searcher.hpp"
 #include "bounding_box_hierarchy.hpp"
+#include "dynamic_bounding_box_hierarchy.hpp"
 #include "exhaustive_searcher.hpp"
+#include "huge_page_allocator.hpp"
+#include "lazy_bounding_box_hierarchy.hpp"
+#include "mapped_bounding_box_hierarchy.hpp"
+#include "motion_bounding_box_hierarchy.hpp"
+#include "numa_replicated_hierarchy.hpp"
+#include "shared_bounding_box_hierarchy.hpp"
 #include "time_invocation.hpp"
 
 using point = std::array<float,3>;
@@ -104,6 +121,39 @@ struct triangle : std::array<point,3>
 };
 
 
+// a triangle whose vertices move linearly from start at time 0 to end at time 1
+struct moving_triangle
+{
+  triangle start;
+  triangle end;
+
+  triangle at(float time) const
+  {
+    triangle result;
+    for(int i = 0; i < 3; ++i)
+    {
+      for(int j = 0; j < 3; ++j)
+      {
+        result[i][j] = (1.f - time) * start[i][j] + time * end[i][j];
+      }
+    }
+
+    return result;
+  }
+
+  // the bounding box at time key
+  std::array<point,2> bounding_box(size_t key) const
+  {
+    return key == 0 ? start.bounding_box() : end.bounding_box();
+  }
+
+  float intersect(const point& origin, const vector& direction, float time, float nearest) const
+  {
+    return at(time).intersect(origin, direction, nearest);
+  }
+};
+
+
 std::vector<triangle> random_triangles_in_unit_cube(size_t n, int seed = 0)
 {
   std::mt19937 rng(seed);
@@ -122,9 +172,132 @@ std::vector<triangle> random_triangles_in_unit_cube(size_t n, int seed = 0)
 }
 
 
+std::vector<triangle> random_small_triangles_in_unit_cube(size_t n, float size = 0.01f, int seed = 0)
+{
+  std::mt19937 rng(seed);
+  std::uniform_real_distribution<float> unit_interval(0,1);
+  std::uniform_real_distribution<float> offset(-size/2, size/2);
+
+  std::vector<triangle> result(n);
+  for(triangle& tri : result)
+  {
+    point center{unit_interval(rng), unit_interval(rng), unit_interval(rng)};
+
+    for(int i = 0; i < 3; ++i)
+    {
+      tri[i] = {center[0] + offset(rng), center[1] + offset(rng), center[2] + offset(rng)};
+    }
+  }
+
+  return result;
+}
+
+
+// a line segment in the plane with double precision coordinates
+using point2d = std::array<double,2>;
+
+struct segment : std::array<point2d,2>
+{
+  double intersect(const point2d& origin, const point2d& direction, double nearest) const
+  {
+    const point2d& p0 = (*this)[0];
+    const point2d& p1 = (*this)[1];
+
+    point2d e{p1[0] - p0[0], p1[1] - p0[1]};
+    point2d d{p0[0] - origin[0], p0[1] - origin[1]};
+
+    double divisor = direction[0] * e[1] - direction[1] * e[0];
+    if(divisor == 0)
+    {
+      return nearest;
+    }
+
+    // compute the parameter along the segment and the hit time along the ray
+    double s = (d[0] * direction[1] - d[1] * direction[0]) / divisor;
+    double t = (d[0] * e[1] - d[1] * e[0]) / divisor;
+
+    if(s < 0 || s > 1 || t < 0)
+    {
+      return nearest;
+    }
+
+    return std::min(nearest, t);
+  }
+
+  std::array<point2d,2> bounding_box() const
+  {
+    point2d min_corner{std::min((*this)[0][0], (*this)[1][0]), std::min((*this)[0][1], (*this)[1][1])};
+    point2d max_corner{std::max((*this)[0][0], (*this)[1][0]), std::max((*this)[0][1], (*this)[1][1])};
+
+    return {min_corner, max_corner};
+  }
+};
+
+
+bool test_2d(size_t num_segments, size_t num_rays)
+{
+  std::mt19937 rng(7);
+  std::uniform_real_distribution<double> unit_interval(0,1);
+  std::uniform_real_distribution<double> offset(-0.05,0.05);
+
+  std::vector<segment> segments(num_segments);
+  for(segment& seg : segments)
+  {
+    point2d center{unit_interval(rng), unit_interval(rng)};
+    seg[0] = {center[0] + offset(rng), center[1] + offset(rng)};
+    seg[1] = {center[0] + offset(rng), center[1] + offset(rng)};
+  }
+
+  // the dimension and scalar type of the hierarchy are deduced from segment::bounding_box()
+  bounding_box_hierarchy<segment> bbh(segments);
+  exhaustive_searcher<segment> es(segments);
+
+  for(size_t i = 0; i < num_rays; ++i)
+  {
+    point2d origin{unit_interval(rng), unit_interval(rng)};
+    point2d direction{unit_interval(rng) - origin[0], unit_interval(rng) - origin[1]};
+
+    if(bbh.intersect(origin, direction, 1.0) != es.intersect(origin, direction, 1.0))
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+
 using ray = std::pair<point,vector>;
 
 
+// small triangles which move by up to distance along a smooth field, so that nearby triangles move alike,
+// like the parts of a deforming object
+std::vector<moving_triangle> random_moving_triangles_in_unit_cube(size_t n, float distance, int seed = 0)
+{
+  const float two_pi = 6.2831853f;
+
+  std::vector<moving_triangle> result;
+  for(const triangle& tri : random_small_triangles_in_unit_cube(n, 0.01f, seed))
+  {
+    const point& p = tri[0];
+    vector velocity{distance * std::sin(two_pi * p[1]), distance * std::sin(two_pi * p[2]), distance * std::sin(two_pi * p[0])};
+
+    moving_triangle moving{tri, tri};
+    for(point& vertex : moving.end)
+    {
+      for(int j = 0; j < 3; ++j)
+      {
+        vertex[j] += velocity[j];
+      }
+    }
+
+    result.push_back(moving);
+  }
+
+  return result;
+}
+
+
 std::vector<ray> random_rays_in_unit_cube(size_t n, int seed = 13)
 {
   std::default_random_engine rng(seed);
@@ -187,63 +360,1449 @@ bool test(const std::vector<triangle>& triangles, const std::vector<ray>& rays)
 }
 
 
-template<class Hierarchy>
-double measure_performance(const Hierarchy& hierarchy, const std::vector<ray>& rays)
+// returns the directions of the primary rays of a camera at eye looking down the +z axis
+// rays are grouped into tile_size x tile_size tiles of adjacent pixels
+std::vector<vector> camera_ray_directions_in_tiles(size_t width, size_t height, size_t tile_size)
 {
-  std::vector<float> results(rays.size());
+  std::vector<vector> result;
+  result.reserve(width * height);
 
-  // warm up
-  for(size_t i = 0; i < rays.size(); ++i)
+  for(size_t tile_y = 0; tile_y < height; tile_y += tile_size)
   {
-    results[i] = hierarchy.intersect(rays[i].first, rays[i].second, 1.f);
+    for(size_t tile_x = 0; tile_x < width; tile_x += tile_size)
+    {
+      for(size_t y = tile_y; y < std::min(tile_y + tile_size, height); ++y)
+      {
+        for(size_t x = tile_x; x < std::min(tile_x + tile_size, width); ++x)
+        {
+          // the image plane covers the unit square at z = 1
+          result.push_back(vector{(x + 0.5f) / width - 0.5f, (y + 0.5f) / height - 0.5f, 1.f});
+        }
+      }
+    }
   }
 
-  size_t milliseconds = time_invocation_in_milliseconds(20, [&]
+  return result;
+}
+
+
+bool test_intersect_tile(const std::vector<triangle>& triangles, size_t tile_size)
+{
+  bounding_box_hierarchy<triangle> bbh(triangles);
+
+  point eye{0.5f, 0.5f, -1.f};
+  auto directions = camera_ray_directions_in_tiles(32, 32, tile_size);
+
+  std::vector<float> expected(directions.size());
+  std::transform(directions.begin(), directions.end(), expected.begin(), [&](const vector& d)
   {
-    for(size_t i = 0; i < rays.size(); ++i)
+    return bbh.intersect(eye, d, 3.f);
+  });
+
+  std::vector<float> results(directions.size());
+  for(size_t tile_begin = 0; tile_begin < directions.size(); tile_begin += tile_size * tile_size)
+  {
+    size_t tile_end = std::min(tile_begin + tile_size * tile_size, directions.size());
+    bbh.intersect_tile(eye, directions.begin() + tile_begin, directions.begin() + tile_end, results.begin() + tile_begin, 3.f);
+  }
+
+  return results == expected;
+}
+
+
+bool test_intersect_rays(const std::vector<triangle>& triangles, const std::vector<ray>& rays, size_t num_threads)
+{
+  bounding_box_hierarchy<triangle> bbh(triangles);
+
+  std::vector<point> origins;
+  std::vector<vector> directions;
+  for(const ray& r : rays)
+  {
+    origins.push_back(r.first);
+    directions.push_back(r.second);
+  }
+
+  std::vector<float> expected(rays.size());
+  std::transform(rays.begin(), rays.end(), expected.begin(), [&](const ray& r)
+  {
+    return bbh.intersect(r.first, r.second, 1.f);
+  });
+
+  std::vector<float> results(rays.size());
+  bbh.intersect_rays(origins.begin(), origins.end(), directions.begin(), results.begin(), 1.f, num_threads);
+
+  std::vector<float> interleaved_results(rays.size());
+  bbh.intersect_interleaved(origins.begin(), origins.end(), directions.begin(), interleaved_results.begin(), 1.f);
+
+  // results need not be default constructible
+  struct hit
+  {
+    explicit hit(float t) : hit_time(t) {}
+
+    float hit_time;
+  };
+
+  std::vector<hit> hits(rays.size(), hit(1.f));
+  bbh.intersect_rays(origins.begin(), origins.end(), directions.begin(), hits.begin(), hit(1.f), num_threads,
+    [](const triangle& tri, const point& origin, const vector& direction, const hit& nearest)
     {
-      results[i] = hierarchy.intersect(rays[i].first, rays[i].second, 1.f);
+      return hit(tri.intersect(origin, direction, nearest.hit_time));
+    },
+    [](const hit& h)
+    {
+      return h.hit_time;
     }
+  );
+
+  bool hits_are_expected = std::equal(hits.begin(), hits.end(), expected.begin(), [](const hit& h, float t)
+  {
+    return h.hit_time == t;
   });
 
-  return 1000 * double(rays.size()) / milliseconds;
+  return results == expected && interleaved_results == expected && hits_are_expected;
 }
 
 
-int main()
+// edits the hierarchy in rounds which remove some triangles and insert others, including triangles removed by
+// earlier rounds, so that nodes and elements freed by removals are reused, and checks it after each round
+bool test_dynamic_bounding_box_hierarchy(const std::vector<triangle>& triangles, const std::vector<ray>& rays)
 {
-  for(size_t i = 0; i < 20; ++i)
+  auto bounder = [](const triangle& tri)
   {
-    std::mt19937 rng(i);
-    std::uniform_int_distribution<> dist(500, 1000);
+    return tri.bounding_box();
+  };
 
-    int m = dist(rng);
-    int n = dist(rng);
+  using hierarchy = dynamic_bounding_box_hierarchy<triangle,3,float,decltype(bounder)>;
 
-    auto triangles = random_triangles_in_unit_cube(dist(rng), rng());
-    auto rays = random_rays_in_unit_cube(dist(rng), rng());
+  // begin with every triangle
+  hierarchy dbbh(bounder);
 
-    std::cout << "testing " << m << " " << n << std::endl;
+  std::vector<hierarchy::handle_type> handles;
+  for(const triangle& tri : triangles)
+  {
+    handles.push_back(dbbh.insert(tri));
+  }
 
-    assert(test<bounding_box_hierarchy<triangle>>(triangles, rays));
+  std::vector<bool> is_inserted(triangles.size(), true);
+
+  std::mt19937 rng(3);
+  std::uniform_int_distribution<size_t> random_triangle(0, triangles.size() - 1);
+
+  for(int round = 0; round < 8; ++round)
+  {
+    // toggle random triangles, removing those which are in the hierarchy and inserting those which are not
+    for(size_t j = 0; j < triangles.size() / 4; ++j)
+    {
+      size_t i = random_triangle(rng);
+
+      if(is_inserted[i])
+      {
+        dbbh.remove(handles[i]);
+      }
+      else
+      {
+        handles[i] = dbbh.insert(triangles[i]);
+      }
+
+      is_inserted[i] = !is_inserted[i];
+    }
+
+    std::vector<triangle> remaining;
+    for(size_t i = 0; i < triangles.size(); ++i)
+    {
+      if(is_inserted[i])
+      {
+        // handles must still identify their triangles after the slots of removed ones have been reused
+        if(!(dbbh[handles[i]] == triangles[i]))
+        {
+          return false;
+        }
+
+        remaining.push_back(triangles[i]);
+      }
+    }
+
+    exhaustive_searcher<triangle> es(remaining);
+
+    for(const ray& r : rays)
+    {
+      if(dbbh.intersect(r.first, r.second, 1.f) != es.intersect(r.first, r.second, 1.f))
+      {
+        return false;
+      }
+    }
   }
 
-  size_t num_triangles = 100000;
-  size_t num_rays = 1 << 10;
+  return true;
+}
 
-  std::mt19937 rng;
-  auto triangles = random_triangles_in_unit_cube(num_triangles, rng());
-  auto rays = random_rays_in_unit_cube(num_rays, rng());
 
-  std::cout << "timing exhaustive_searcher: " << std::endl;
+bool test_mapped_bounding_box_hierarchy(const std::vector<triangle>& triangles, const std::vector<ray>& rays, size_t max_elements_in_memory)
+{
+  // write the triangles to a file
+  {
+    std::FILE* file = std::fopen("demo_triangles.bin", "wb");
+    std::fwrite(triangles.data(), sizeof(triangle), triangles.size(), file);
+    std::fclose(file);
+  }
+
+  // build from a stream with room for only a fraction of the triangles in memory
+  mapped_bounding_box_hierarchy<triangle>::build(file_source<triangle>("demo_triangles.bin"), "demo_hierarchy.bin",
+    [](const triangle& tri) { return tri.bounding_box(); },
+    minimize_surface_area_heuristic(),
+    max_elements_in_memory
+  );
+
+  bool result = true;
+
+  {
+    mapped_array<triangle> mapped_triangles("demo_triangles.bin");
+    mapped_bounding_box_hierarchy<triangle> mbbh("demo_hierarchy.bin", mapped_triangles);
+
+    exhaustive_searcher<triangle> es(triangles);
+
+    for(const ray& r : rays)
+    {
+      if(mbbh.intersect(r.first, r.second, 1.f) != es.intersect(r.first, r.second, 1.f))
+      {
+        result = false;
+      }
+    }
+  }
+
+  std::vector<char> contents;
+  {
+    mapped_array<char> file("demo_hierarchy.bin");
+    contents.assign(file.begin(), file.end());
+  }
+
+  // the header is four 64b integers followed by the hierarchy's bounding box, and
+  // each node is a bounding box followed by the 64b references to its two children
+  using box = decltype(std::declval<triangle>().bounding_box());
+  size_t first_node = 4 * sizeof(uint64_t) + sizeof(box);
+
+  // the first node refers to itself as its left child, which would make intersect() loop forever
+  std::vector<char> cyclic = contents;
+  std::fill(cyclic.begin() + first_node + sizeof(box), cyclic.begin() + first_node + sizeof(box) + sizeof(uint64_t), 0);
+
+  // files which are too short to hold a header, whose nodes were cut off, or whose nodes refer to invalid children
+  // must be rejected rather than read
+  for(std::vector<char> corrupted : {std::vector<char>(contents.begin(), contents.begin() + 10),
+                                     std::vector<char>(contents.begin(), contents.end() - 1),
+                                     cyclic})
+  {
+    {
+      std::FILE* file = std::fopen("demo_corrupted.bin", "wb");
+      std::fwrite(corrupted.data(), 1, corrupted.size(), file);
+      std::fclose(file);
+    }
+
+    try
+    {
+      mapped_array<triangle> mapped_triangles("demo_triangles.bin");
+      mapped_bounding_box_hierarchy<triangle> mbbh("demo_corrupted.bin", mapped_triangles);
+      result = false;
+    }
+    catch(std::runtime_error&)
+    {
+    }
+  }
+
+  std::remove("demo_triangles.bin");
+  std::remove("demo_hierarchy.bin");
+  std::remove("demo_corrupted.bin");
+
+  return result;
+}
+
+
+// small triangles spread through the unit cube, a dense cluster of triangles which all fall in a single Morton cell,
+// and many copies of a single triangle, whose centroids no grid can divide
+std::vector<triangle> clustered_triangles(size_t n)
+{
+  auto result = random_small_triangles_in_unit_cube(n / 2, 0.05f, 1);
+
+  for(triangle tri : random_small_triangles_in_unit_cube(n / 4, 0.05f, 2))
+  {
+    for(point& p : tri)
+    {
+      for(float& x : p)
+      {
+        x = 0.5f + 1e-3f * x;
+      }
+    }
+
+    result.push_back(tri);
+  }
+
+  result.insert(result.end(), n / 4, result.front());
+
+  return result;
+}
+
+
+bool test_copy(const std::vector<triangle>& triangles, const std::vector<ray>& rays)
+{
+  auto original = std::make_unique<bounding_box_hierarchy<triangle>>(triangles);
+  bounding_box_hierarchy<triangle> copy = *original;
+
+  std::vector<float> expected;
+  for(const ray& r : rays)
+  {
+    expected.push_back(original->intersect(r.first, r.second, 1.f));
+  }
+
+  // the copy must not refer to the original's nodes
+  original.reset();
+
+  for(size_t i = 0; i < rays.size(); ++i)
+  {
+    if(copy.intersect(rays[i].first, rays[i].second, 1.f) != expected[i])
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+
+// a partitioner which splits off one element at a time, which makes a tree as deep as it has elements
+struct partition_first_element
+{
+  template<class Iterator, class BoundingBox, class Bounder>
+  Iterator operator()(Iterator first, Iterator, const BoundingBox&, Bounder) const
+  {
+    return first + 1;
+  }
+};
+
+
+// traversals of a tree deeper than their stacks' inline storage must still visit every node
+bool test_deep_hierarchy(const std::vector<triangle>& triangles, const std::vector<ray>& rays)
+{
+  bounding_box_hierarchy<triangle> bbh(triangles, [](const triangle& tri) { return tri.bounding_box(); }, partition_first_element());
   exhaustive_searcher<triangle> es(triangles);
-  auto es_rays_per_second = measure_performance(es, rays);
-  std::cout << "exhaustive_searcher: " << es_rays_per_second << " rays/s" << std::endl;
 
-  std::cout << "timing bounding_box_hierarchy: " << std::endl;
-  bounding_box_hierarchy<triangle> bbh(triangles);
-  auto bbh_rays_per_second = measure_performance(bbh, rays);
-  std::cout << "bounding_box_hierarchy: " << bbh_rays_per_second << " rays/s" << std::endl;
+  std::vector<point> origins;
+  std::vector<vector> directions;
+  for(const ray& r : rays)
+  {
+    origins.push_back(r.first);
+    directions.push_back(r.second);
+  }
+
+  std::vector<float> results(rays.size());
+  bbh.intersect_interleaved(origins.begin(), origins.end(), directions.begin(), results.begin(), 1.f);
+
+  for(size_t i = 0; i < rays.size(); ++i)
+  {
+    float expected = es.intersect(rays[i].first, rays[i].second, 1.f);
+    if(bbh.intersect(rays[i].first, rays[i].second, 1.f) != expected || results[i] != expected)
+    {
+      return false;
+    }
+  }
+
+  size_t num_overlaps = 0;
+  bbh.query_overlaps(bbh.bounding_box(), [&](const triangle&)
+  {
+    ++num_overlaps;
+  });
+
+  return num_overlaps == triangles.size();
+}
+
+
+bool test_replicas(const std::vector<triangle>& triangles, const std::vector<ray>& rays)
+{
+  using hierarchy = bounding_box_hierarchy<triangle,3,float,huge_page_allocator<triangle>>;
+
+  hierarchy original(triangles);
+
+  // a copy which refers to a copy of the triangles
+  std::vector<triangle> copied_triangles = triangles;
+  hierarchy copy(original, copied_triangles);
+
+  numa_replicated_hierarchy<hierarchy> replicated(triangles);
+
+  auto intersector = [](const triangle& tri, const point& o, const vector& d, intersection_type nearest)
+  {
+    float t = tri.intersect(o, d, nearest.first);
+    return t < nearest.first ? intersection_type(t, &tri) : nearest;
+  };
+
+  for(const ray& r : rays)
+  {
+    intersection_type expected = original.intersect(r.first, r.second, intersection_type(1.f, nullptr), intersector);
+    intersection_type result = copy.intersect(r.first, r.second, intersection_type(1.f, nullptr), intersector);
+
+    // the copy must hit the same triangle, but in copied_triangles
+    if(result.first != expected.first)
+    {
+      return false;
+    }
+
+    if(expected.second && result.second != copied_triangles.data() + (expected.second - triangles.data()))
+    {
+      return false;
+    }
+
+    if(replicated.intersect(r.first, r.second, 1.f) != expected.first)
+    {
+      return false;
+    }
+  }
+
+  // an allocation whose size in bytes overflows must throw rather than allocate too little
+  try
+  {
+    huge_page_allocator<triangle>().allocate(std::size_t(-1) / sizeof(triangle) + 1);
+    return false;
+  }
+  catch(const std::bad_array_new_length&)
+  {
+  }
+
+  return true;
+}
+
+
+// queries a single hierarchy from many threads while another thread repeatedly publishes rebuilt hierarchies
+bool test_concurrent_queries(std::vector<triangle> triangles, const std::vector<ray>& rays, size_t num_threads)
+{
+  using hierarchy = shared_bounding_box_hierarchy<triangle>;
+
+  std::vector<float> expected;
+  {
+    exhaustive_searcher<triangle> es(triangles);
+    for(const ray& r : rays)
+    {
+      expected.push_back(es.intersect(r.first, r.second, 1.f));
+    }
+  }
+
+  hierarchy_publisher<hierarchy> publisher{hierarchy(std::move(triangles))};
+
+  std::atomic<bool> done{false};
+  std::atomic<size_t> num_errors{0};
+
+  std::vector<std::thread> readers;
+  for(size_t t = 0; t < num_threads; ++t)
+  {
+    readers.emplace_back([&]
+    {
+      for(int iteration = 0; iteration < 20; ++iteration)
+      {
+        // hold a snapshot for the duration of the pass over the rays
+        auto snapshot = publisher.load();
+
+        for(size_t i = 0; i < rays.size(); ++i)
+        {
+          if(snapshot->intersect(rays[i].first, rays[i].second, 1.f) != expected[i])
+          {
+            ++num_errors;
+          }
+        }
+      }
+    });
+  }
+
+  std::thread writer([&]
+  {
+    while(!done)
+    {
+      // rebuild over the same elements, sharing their storage
+      auto current = publisher.load();
+      publisher.publish(hierarchy(current->shared_elements(), [](const triangle& tri) { return tri.bounding_box(); }, partition_largest_axis_at_middle_element()));
+    }
+  });
+
+  for(auto& reader : readers)
+  {
+    reader.join();
+  }
+
+  done = true;
+  writer.join();
+
+  return num_errors == 0;
+}
+
+
+// returns the number of elements at which bounding_box_hierarchy becomes faster than blocked_exhaustive_searcher
+size_t measure_crossover(const std::vector<ray>& rays)
+{
+  for(size_t n = 8; n <= 1024; n *= 2)
+  {
+    // scale the triangles so that each ray hits a similar fraction of the scene regardless of n
+    auto triangles = random_small_triangles_in_unit_cube(n, 1.f / std::cbrt(float(n)));
+
+    blocked_exhaustive_searcher<triangle> es(triangles);
+    bounding_box_hierarchy<triangle> bbh(triangles);
+
+    std::vector<float> results(rays.size());
+
+    size_t es_nanoseconds = time_invocation_in_nanoseconds(20, [&]
+    {
+      for(size_t i = 0; i < rays.size(); ++i)
+      {
+        results[i] = es.intersect(rays[i].first, rays[i].second, 1.f);
+      }
+    });
+
+    size_t bbh_nanoseconds = time_invocation_in_nanoseconds(20, [&]
+    {
+      for(size_t i = 0; i < rays.size(); ++i)
+      {
+        results[i] = bbh.intersect(rays[i].first, rays[i].second, 1.f);
+      }
+    });
+
+    std::cout << "  " << n << " elements: blocked_exhaustive_searcher " << es_nanoseconds / rays.size() << " ns/ray, bounding_box_hierarchy " << bbh_nanoseconds / rays.size() << " ns/ray" << std::endl;
+
+    if(bbh_nanoseconds < es_nanoseconds)
+    {
+      return n;
+    }
+  }
+
+  return 1024;
+}
+
+
+struct sphere
+{
+  point center;
+  float radius;
+
+  // a sphere overlaps a box if the point of the box nearest the center lies within the sphere
+  bool overlaps(const std::array<point,2>& box) const
+  {
+    float distance_squared = 0;
+    for(int i = 0; i < 3; ++i)
+    {
+      float nearest = std::max(box[0][i], std::min(center[i], box[1][i]));
+      distance_squared += (nearest - center[i]) * (nearest - center[i]);
+    }
+
+    return distance_squared <= radius * radius;
+  }
+
+  std::array<point,2> bounding_box() const
+  {
+    return {{{center[0] - radius, center[1] - radius, center[2] - radius},
+             {center[0] + radius, center[1] + radius, center[2] + radius}}};
+  }
+
+  // a moving sphere touches this sphere when the distance between their centers falls to the sum of their radii
+  float intersect(const point& origin, const vector& direction, float moving_radius, float nearest) const
+  {
+    vector offset = origin - center;
+    float contact_distance = radius + moving_radius;
+
+    float a = dot(direction, direction);
+    float b = dot(offset, direction);
+    float c = dot(offset, offset) - contact_distance * contact_distance;
+
+    // the spheres already touch
+    if(c <= 0) return std::min(nearest, 0.f);
+
+    float discriminant = b * b - a * c;
+    if(discriminant < 0) return nearest;
+
+    float t = (-b - std::sqrt(discriminant)) / a;
+    if(t < 0) return nearest;
+
+    return std::min(nearest, t);
+  }
+};
+
+
+template<class Searcher, class Region, class Bounder = call_member_bounding_box>
+std::vector<const triangle*> find_overlaps(const Searcher& searcher, const Region& region, Bounder bounder = call_member_bounding_box())
+{
+  std::vector<const triangle*> result;
+  searcher.query_overlaps(region, [&](const triangle& tri)
+  {
+    result.push_back(&tri);
+  }, call_member_overlaps(), bounder);
+
+  std::sort(result.begin(), result.end());
+  return result;
+}
+
+
+bool test_query_overlaps(const std::vector<triangle>& triangles)
+{
+  bounding_box_hierarchy<triangle> bbh(triangles);
+  exhaustive_searcher<triangle> es(triangles);
+
+  std::mt19937 rng(3);
+  std::uniform_real_distribution<float> unit_interval(0,1);
+
+  for(int i = 0; i < 100; ++i)
+  {
+    point center{unit_interval(rng), unit_interval(rng), unit_interval(rng)};
+    float radius = unit_interval(rng) / 10;
+
+    std::array<point,2> box{{{center[0] - radius, center[1] - radius, center[2] - radius},
+                             {center[0] + radius, center[1] + radius, center[2] + radius}}};
+
+    if(find_overlaps(bbh, box) != find_overlaps(es, box))
+    {
+      return false;
+    }
+
+    if(find_overlaps(bbh, sphere{center, radius}) != find_overlaps(es, sphere{center, radius}))
+    {
+      return false;
+    }
+  }
+
+  // hierarchies built with a custom bounder test elements against that bounder's boxes when it is passed to the query
+  auto enlarged_bounder = [](const triangle& tri)
+  {
+    auto box = tri.bounding_box();
+    for(int i = 0; i < 3; ++i)
+    {
+      box[0][i] -= 0.05f;
+      box[1][i] += 0.05f;
+    }
+
+    return box;
+  };
+
+  bounding_box_hierarchy<triangle> enlarged_bbh(triangles, enlarged_bounder);
+  exhaustive_searcher<triangle> enlarged_es(triangles, enlarged_bounder);
+
+  bool found_more_overlaps = false;
+  for(int i = 0; i < 100; ++i)
+  {
+    point center{unit_interval(rng), unit_interval(rng), unit_interval(rng)};
+    float radius = unit_interval(rng) / 10;
+
+    std::array<point,2> box{{{center[0] - radius, center[1] - radius, center[2] - radius},
+                             {center[0] + radius, center[1] + radius, center[2] + radius}}};
+
+    auto overlaps = find_overlaps(enlarged_bbh, box, enlarged_bounder);
+    if(overlaps != find_overlaps(enlarged_es, box, enlarged_bounder))
+    {
+      return false;
+    }
+
+    found_more_overlaps |= overlaps.size() > find_overlaps(bbh, box).size();
+  }
+
+  if(!found_more_overlaps)
+  {
+    return false;
+  }
+
+  // stop after the first overlap
+  size_t num_overlaps = 0;
+  bool completed = bbh.query_overlaps(bbh.bounding_box(), [&](const triangle&)
+  {
+    ++num_overlaps;
+    return false;
+  });
+
+  return !completed && num_overlaps == 1;
+}
+
+
+bool boxes_overlap(const triangle& a, const triangle& b)
+{
+  auto a_box = a.bounding_box();
+  auto b_box = b.bounding_box();
+
+  for(int i = 0; i < 3; ++i)
+  {
+    if(a_box[1][i] < b_box[0][i] || b_box[1][i] < a_box[0][i]) return false;
+  }
+
+  return true;
+}
+
+
+bool test_multiple_hits(const std::vector<triangle>& triangles, const std::vector<ray>& rays, size_t k)
+{
+  bounding_box_hierarchy<triangle> bbh(triangles);
+
+  auto intersector = [](const triangle& tri, const point& o, const vector& d, intersection_type nearest)
+  {
+    float t = tri.intersect(o, d, nearest.first);
+    return t < nearest.first ? intersection_type(t, &tri) : nearest;
+  };
+
+  for(const ray& r : rays)
+  {
+    // every hit, in order
+    std::vector<intersection_type> expected;
+    for(const triangle& tri : triangles)
+    {
+      float t = tri.intersect(r.first, r.second, 1.f);
+      if(t < 1.f)
+      {
+        expected.emplace_back(t, &tri);
+      }
+    }
+    std::sort(expected.begin(), expected.end());
+
+    std::vector<intersection_type> all_hits;
+    bbh.for_each_intersection(r.first, r.second, intersection_type(1.f, nullptr), [&](const triangle&, const intersection_type& hit)
+    {
+      all_hits.push_back(hit);
+    }, intersector);
+    std::sort(all_hits.begin(), all_hits.end());
+
+    if(all_hits != expected)
+    {
+      return false;
+    }
+
+    std::vector<intersection_type> nearest_hits(k);
+    auto nearest_hits_end = bbh.intersect_nearest(r.first, r.second, intersection_type(1.f, nullptr), nearest_hits.begin(), nearest_hits.end(), intersector);
+    nearest_hits.erase(nearest_hits_end, nearest_hits.end());
+
+    // hits at the same time may be reported in either order, so compare times, and check that each hit is genuine
+    expected.resize(std::min(expected.size(), k));
+    if(nearest_hits.size() != expected.size())
+    {
+      return false;
+    }
+
+    for(size_t i = 0; i < nearest_hits.size(); ++i)
+    {
+      if(nearest_hits[i].first != expected[i].first || nearest_hits[i].second->intersect(r.first, r.second, 1.f) != nearest_hits[i].first)
+      {
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+
+// queries a lazy_bounding_box_hierarchy from many threads at once, so that they race to expand its placeholders
+template<class Partitioner = minimize_surface_area_heuristic>
+bool test_lazy_bounding_box_hierarchy(const std::vector<triangle>& triangles, const std::vector<ray>& rays, size_t num_threads,
+                                      Partitioner partitioner = Partitioner())
+{
+  bounding_box_hierarchy<triangle> bbh(triangles);
+
+  std::vector<float> expected;
+  for(const ray& r : rays)
+  {
+    expected.push_back(bbh.intersect(r.first, r.second, 1.f));
+  }
+
+  // expand only a level at a time, to make many placeholders
+  lazy_bounding_box_hierarchy<triangle,3,float,Partitioner> lazy(triangles, [](const triangle& tri) { return tri.bounding_box(); }, partitioner, 1);
+
+  // construction must not build the whole tree
+  if(lazy.num_nodes() >= triangles.size() - 1)
+  {
+    return false;
+  }
+
+  std::atomic<size_t> num_errors{0};
+
+  std::vector<std::thread> threads;
+  for(size_t t = 0; t < num_threads; ++t)
+  {
+    threads.emplace_back([&,t]
+    {
+      // each thread begins at a different ray
+      for(size_t j = 0; j < rays.size(); ++j)
+      {
+        size_t i = (j + t * rays.size() / num_threads) % rays.size();
+        if(lazy.intersect(rays[i].first, rays[i].second, 1.f) != expected[i])
+        {
+          ++num_errors;
+        }
+      }
+    });
+  }
+
+  for(auto& thread : threads)
+  {
+    thread.join();
+  }
+
+  return num_errors == 0 && lazy.num_nodes() <= triangles.size() - 1;
+}
+
+
+bool test_empty_lazy_bounding_box_hierarchy(const std::vector<ray>& rays)
+{
+  std::vector<triangle> no_triangles;
+  lazy_bounding_box_hierarchy<triangle> lazy(no_triangles);
+
+  // an empty box contains no points
+  auto box = lazy.bounding_box();
+  if(!(box[1][0] < box[0][0]))
+  {
+    return false;
+  }
+
+  for(const ray& r : rays)
+  {
+    if(lazy.intersect(r.first, r.second, 1.f) != 1.f)
+    {
+      return false;
+    }
+  }
+
+  return lazy.num_nodes() == 0;
+}
+
+
+bool test_motion_bounding_box_hierarchy(const std::vector<moving_triangle>& triangles, const std::vector<ray>& rays)
+{
+  motion_bounding_box_hierarchy<moving_triangle> mbbh(triangles);
+
+  std::mt19937 rng(7);
+  std::uniform_real_distribution<float> unit_interval(0,1);
+
+  for(const ray& r : rays)
+  {
+    float time = unit_interval(rng);
+
+    // compare with every triangle
+    float expected = 1.f;
+    for(const moving_triangle& tri : triangles)
+    {
+      expected = tri.intersect(r.first, r.second, time, expected);
+    }
+
+    if(mbbh.intersect(r.first, r.second, time, 1.f) != expected)
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+
+bool test_sphere_cast(size_t num_spheres, size_t num_casts)
+{
+  std::mt19937 rng(5);
+  std::uniform_real_distribution<float> unit_interval(0,1);
+
+  std::vector<sphere> spheres(num_spheres);
+  for(sphere& s : spheres)
+  {
+    s = sphere{{unit_interval(rng), unit_interval(rng), unit_interval(rng)}, unit_interval(rng) / 100};
+  }
+
+  bounding_box_hierarchy<sphere> bbh(spheres);
+
+  using contact_type = std::pair<float, const sphere*>;
+
+  for(const ray& r : random_rays_in_unit_cube(num_casts, 11))
+  {
+    float radius = unit_interval(rng) / 20;
+
+    // compare with every sphere
+    contact_type expected(1.f, nullptr);
+    for(const sphere& s : spheres)
+    {
+      float t = s.intersect(r.first, r.second, radius, expected.first);
+      if(t < expected.first)
+      {
+        expected = contact_type(t, &s);
+      }
+    }
+
+    if(bbh.sphere_cast(r.first, r.second, radius, 1.f) != expected.first)
+    {
+      return false;
+    }
+
+    // find the sphere as well as the time of contact
+    contact_type result = bbh.sphere_cast(r.first, r.second, radius, contact_type(1.f, nullptr), [](const sphere& s, const point& o, const vector& d, float radius, contact_type nearest)
+    {
+      return contact_type(s.intersect(o, d, radius, nearest.first), &s);
+    });
+
+    // spheres which already touch the moving sphere tie at time 0, so any of them may be reported
+    if(result.first != expected.first || (result.second && result.second->intersect(r.first, r.second, radius, 1.f) != result.first))
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+
+bool test_for_each_overlapping_pair(const std::vector<triangle>& triangles1, const std::vector<triangle>& triangles2, size_t num_threads)
+{
+  using pair = std::pair<const triangle*, const triangle*>;
+
+  // find the pairs by brute force
+  std::set<pair> expected_pairs;
+  std::set<pair> expected_self_pairs;
+  for(const triangle& a : triangles1)
+  {
+    for(const triangle& b : triangles2)
+    {
+      if(boxes_overlap(a, b)) expected_pairs.emplace(&a, &b);
+    }
+
+    for(const triangle& b : triangles1)
+    {
+      if(&a < &b && boxes_overlap(a, b)) expected_self_pairs.emplace(&a, &b);
+    }
+  }
+
+  bounding_box_hierarchy<triangle> bbh1(triangles1);
+  bounding_box_hierarchy<triangle> bbh2(triangles2);
+
+  std::mutex mutex;
+  std::vector<pair> pairs;
+  bbh1.for_each_overlapping_pair(bbh2, [&](const triangle& a, const triangle& b)
+  {
+    std::lock_guard<std::mutex> guard(mutex);
+    pairs.emplace_back(&a, &b);
+  }, num_threads);
+
+  std::vector<pair> self_pairs;
+  bbh1.for_each_overlapping_pair([&](const triangle& a, const triangle& b)
+  {
+    std::lock_guard<std::mutex> guard(mutex);
+    self_pairs.push_back(std::minmax(&a, &b));
+  }, num_threads);
+
+  // each pair must be reported exactly once
+  return pairs.size() == expected_pairs.size() && std::set<pair>(pairs.begin(), pairs.end()) == expected_pairs &&
+         self_pairs.size() == expected_self_pairs.size() && std::set<pair>(self_pairs.begin(), self_pairs.end()) == expected_self_pairs;
+}
+
+
+template<class Hierarchy>
+double measure_performance(const Hierarchy& hierarchy, const std::vector<ray>& rays)
+{
+  std::vector<float> results(rays.size());
+
+  // warm up
+  for(size_t i = 0; i < rays.size(); ++i)
+  {
+    results[i] = hierarchy.intersect(rays[i].first, rays[i].second, 1.f);
+  }
+
+  size_t milliseconds = time_invocation_in_milliseconds(20, [&]
+  {
+    for(size_t i = 0; i < rays.size(); ++i)
+    {
+      results[i] = hierarchy.intersect(rays[i].first, rays[i].second, 1.f);
+    }
+  });
+
+  return 1000 * double(rays.size()) / milliseconds;
+}
+
+
+template<class Hierarchy>
+double measure_tile_performance(const Hierarchy& hierarchy, const point& eye, const std::vector<vector>& directions, size_t tile_size)
+{
+  std::vector<float> results(directions.size());
+
+  size_t num_rays_per_tile = tile_size * tile_size;
+
+  size_t milliseconds = time_invocation_in_milliseconds(20, [&]
+  {
+    for(size_t tile_begin = 0; tile_begin < directions.size(); tile_begin += num_rays_per_tile)
+    {
+      size_t tile_end = std::min(tile_begin + num_rays_per_tile, directions.size());
+      hierarchy.intersect_tile(eye, directions.begin() + tile_begin, directions.begin() + tile_end, results.begin() + tile_begin, 3.f);
+    }
+  });
+
+  return 1000 * double(directions.size()) / std::max<size_t>(milliseconds, 1);
+}
+
+
+template<class Hierarchy>
+double measure_per_ray_performance(const Hierarchy& hierarchy, const point& eye, const std::vector<vector>& directions)
+{
+  std::vector<float> results(directions.size());
+
+  size_t milliseconds = time_invocation_in_milliseconds(20, [&]
+  {
+    for(size_t i = 0; i < directions.size(); ++i)
+    {
+      results[i] = hierarchy.intersect(eye, directions[i], 3.f);
+    }
+  });
+
+  return 1000 * double(directions.size()) / std::max<size_t>(milliseconds, 1);
+}
+
+
+template<class Hierarchy>
+std::array<double,3> measure_incoherent_performance(const Hierarchy& hierarchy, const std::vector<ray>& rays)
+{
+  std::vector<point> origins;
+  std::vector<vector> directions;
+  for(const ray& r : rays)
+  {
+    origins.push_back(r.first);
+    directions.push_back(r.second);
+  }
+
+  std::vector<float> results(rays.size());
+
+  size_t one_at_a_time_milliseconds = time_invocation_in_milliseconds(3, [&]
+  {
+    for(size_t i = 0; i < rays.size(); ++i)
+    {
+      results[i] = hierarchy.intersect(origins[i], directions[i], 1.f);
+    }
+  });
+
+  size_t interleaved_milliseconds = time_invocation_in_milliseconds(3, [&]
+  {
+    hierarchy.intersect_interleaved(origins.begin(), origins.end(), directions.begin(), results.begin(), 1.f);
+  });
+
+  size_t sorted_milliseconds = time_invocation_in_milliseconds(3, [&]
+  {
+    hierarchy.intersect_rays(origins.begin(), origins.end(), directions.begin(), results.begin(), 1.f);
+  });
+
+  return {{1000 * double(rays.size()) / std::max<size_t>(one_at_a_time_milliseconds, 1),
+           1000 * double(rays.size()) / std::max<size_t>(interleaved_milliseconds, 1),
+           1000 * double(rays.size()) / std::max<size_t>(sorted_milliseconds, 1)}};
+}
+
+
+int main()
+{
+  for(size_t i = 0; i < 20; ++i)
+  {
+    std::mt19937 rng(i);
+    std::uniform_int_distribution<> dist(500, 1000);
+
+    int m = dist(rng);
+    int n = dist(rng);
+
+    auto triangles = random_triangles_in_unit_cube(dist(rng), rng());
+    auto rays = random_rays_in_unit_cube(dist(rng), rng());
+
+    std::cout << "testing " << m << " " << n << std::endl;
+
+    assert(test<bounding_box_hierarchy<triangle>>(triangles, rays));
+  }
+
+  std::cout << "testing 2D bounding_box_hierarchy" << std::endl;
+  assert(test_2d(5000, 1000));
+
+  std::cout << "testing dynamic_bounding_box_hierarchy" << std::endl;
+  assert(test_dynamic_bounding_box_hierarchy(random_small_triangles_in_unit_cube(5000, 0.05f), random_rays_in_unit_cube(1000)));
+
+  std::cout << "testing mapped_bounding_box_hierarchy" << std::endl;
+  assert(test_mapped_bounding_box_hierarchy(random_small_triangles_in_unit_cube(5000, 0.05f), random_rays_in_unit_cube(1000), 5000 / 8));
+  assert(test_mapped_bounding_box_hierarchy(clustered_triangles(5000), random_rays_in_unit_cube(1000), 5000 / 8));
+
+  std::cout << "testing copies of bounding_box_hierarchy" << std::endl;
+  assert(test_copy(random_small_triangles_in_unit_cube(5000, 0.05f), random_rays_in_unit_cube(1000)));
+
+  std::cout << "testing a bounding_box_hierarchy deeper than its traversal stacks" << std::endl;
+  assert(test_deep_hierarchy(random_small_triangles_in_unit_cube(300, 0.05f), random_rays_in_unit_cube(1000)));
+
+  std::cout << "testing replicas of bounding_box_hierarchy" << std::endl;
+  assert(test_replicas(random_triangles_in_unit_cube(5000), random_rays_in_unit_cube(1000)));
+
+  std::cout << "testing concurrent queries" << std::endl;
+  assert(test_concurrent_queries(random_small_triangles_in_unit_cube(5000, 0.05f), random_rays_in_unit_cube(1000), 8));
+
+  std::cout << "testing blocked_exhaustive_searcher" << std::endl;
+  assert(test<blocked_exhaustive_searcher<triangle>>(random_small_triangles_in_unit_cube(37, 0.2f), random_rays_in_unit_cube(1000)));
+  assert(test<blocked_exhaustive_searcher<triangle>>(random_small_triangles_in_unit_cube(1000, 0.05f), random_rays_in_unit_cube(1000)));
+
+  std::cout << "testing adaptive_searcher" << std::endl;
+  assert(test<adaptive_searcher<triangle>>(random_small_triangles_in_unit_cube(40, 0.2f), random_rays_in_unit_cube(1000)));
+  assert(test<adaptive_searcher<triangle>>(random_small_triangles_in_unit_cube(4000, 0.05f), random_rays_in_unit_cube(1000)));
+
+  std::cout << "testing query_overlaps" << std::endl;
+  assert(test_query_overlaps(random_small_triangles_in_unit_cube(5000, 0.05f)));
+
+  std::cout << "testing for_each_intersection and intersect_nearest" << std::endl;
+  assert(test_multiple_hits(random_triangles_in_unit_cube(1000), random_rays_in_unit_cube(500), 1));
+  assert(test_multiple_hits(random_triangles_in_unit_cube(1000), random_rays_in_unit_cube(500), 4));
+  assert(test_multiple_hits(random_triangles_in_unit_cube(1000), random_rays_in_unit_cube(500), 1000));
+
+  std::cout << "testing lazy_bounding_box_hierarchy" << std::endl;
+  assert(test_lazy_bounding_box_hierarchy(random_small_triangles_in_unit_cube(5000, 0.05f), random_rays_in_unit_cube(1000), 1));
+  assert(test_lazy_bounding_box_hierarchy(random_small_triangles_in_unit_cube(5000, 0.05f), random_rays_in_unit_cube(1000), 8));
+  assert(test_empty_lazy_bounding_box_hierarchy(random_rays_in_unit_cube(10)));
+  {
+    // partitioners which keep state between a node and its children, expanded from several threads at once
+    auto rays = random_rays_in_unit_cube(1000);
+    std::vector<point> origins;
+    std::vector<vector> directions;
+    for(const ray& r : rays)
+    {
+      origins.push_back(r.first);
+      directions.push_back(r.second);
+    }
+
+    minimize_ray_distribution_heuristic<> partitioner(origins.begin(), origins.end(), directions.begin(), 1.f);
+    assert(test_lazy_bounding_box_hierarchy(random_small_triangles_in_unit_cube(5000, 0.05f), rays, 8, partitioner));
+  }
+
+  std::cout << "testing motion_bounding_box_hierarchy" << std::endl;
+  assert(test_motion_bounding_box_hierarchy(random_moving_triangles_in_unit_cube(5000, 0.1f), random_rays_in_unit_cube(1000)));
+  assert(test_motion_bounding_box_hierarchy(random_moving_triangles_in_unit_cube(1, 0.1f), random_rays_in_unit_cube(1000)));
+  assert(test_motion_bounding_box_hierarchy(std::vector<moving_triangle>(), random_rays_in_unit_cube(10)));
+
+  std::cout << "testing sphere_cast" << std::endl;
+  assert(test_sphere_cast(5000, 1000));
+
+  std::cout << "testing for_each_overlapping_pair" << std::endl;
+  assert(test_for_each_overlapping_pair(random_small_triangles_in_unit_cube(2000, 0.05f, 1), random_small_triangles_in_unit_cube(1500, 0.05f, 2), 1));
+  assert(test_for_each_overlapping_pair(random_small_triangles_in_unit_cube(2000, 0.05f, 1), random_small_triangles_in_unit_cube(1500, 0.05f, 2), 4));
+
+  std::cout << "testing intersect_rays" << std::endl;
+  assert(test_intersect_rays(random_small_triangles_in_unit_cube(10000, 0.05f), random_rays_in_unit_cube(5000), 1));
+  assert(test_intersect_rays(random_small_triangles_in_unit_cube(10000, 0.05f), random_rays_in_unit_cube(5000), 4));
+
+  std::cout << "testing intersect_tile" << std::endl;
+  assert(test_intersect_tile(random_small_triangles_in_unit_cube(10000, 0.05f), 8));
+  assert(test_intersect_tile(random_small_triangles_in_unit_cube(10000, 0.05f), 5));
+
+  size_t num_triangles = 100000;
+  size_t num_rays = 1 << 10;
+
+  std::mt19937 rng;
+  auto triangles = random_triangles_in_unit_cube(num_triangles, rng());
+  auto rays = random_rays_in_unit_cube(num_rays, rng());
+
+  std::cout << "timing exhaustive_searcher: " << std::endl;
+  exhaustive_searcher<triangle> es(triangles);
+  auto es_rays_per_second = measure_performance(es, rays);
+  std::cout << "exhaustive_searcher: " << es_rays_per_second << " rays/s" << std::endl;
+
+  std::cout << "measuring crossover between blocked_exhaustive_searcher and bounding_box_hierarchy: " << std::endl;
+  size_t crossover = measure_crossover(rays);
+  std::cout << "crossover: " << crossover << " elements (adaptive_searcher uses " << adaptive_searcher<triangle>::default_crossover << ")" << std::endl;
+
+  std::cout << "timing bounding_box_hierarchy construction: " << std::endl;
+  {
+    size_t sah_milliseconds = time_invocation_in_milliseconds(1, [&]
+    {
+      bounding_box_hierarchy<triangle> bbh(triangles);
+    });
+    std::cout << "bounding_box_hierarchy with surface area heuristic: " << sah_milliseconds << " ms" << std::endl;
+
+    size_t median_milliseconds = time_invocation_in_milliseconds(1, [&]
+    {
+      bounding_box_hierarchy<triangle> bbh(triangles, [](const triangle& tri) { return tri.bounding_box(); }, partition_largest_axis_at_middle_element());
+    });
+    std::cout << "bounding_box_hierarchy with median split: " << median_milliseconds << " ms" << std::endl;
+  }
+
+  std::cout << "timing bounding_box_hierarchy: " << std::endl;
+  bounding_box_hierarchy<triangle> bbh(triangles);
+  auto bbh_rays_per_second = measure_performance(bbh, rays);
+  std::cout << "bounding_box_hierarchy: " << bbh_rays_per_second << " rays/s" << std::endl;
+
+  {
+    std::cout << "measuring bounding_box_hierarchy with performance counters: " << std::endl;
+    if(!performance_counters().is_available())
+    {
+      std::cout << "hardware counters are unavailable, measuring time only" << std::endl;
+    }
+
+    performance_sample build;
+    {
+      scoped_performance_measurement measure(build);
+      bounding_box_hierarchy<triangle> bbh(triangles);
+    }
+    std::cout << "construction: " << build << std::endl;
+
+    performance_statistics queries = measure_invocation(5, [&]
+    {
+      for(const ray& r : rays)
+      {
+        bbh.intersect(r.first, r.second, 1.f);
+      }
+    });
+    std::cout << "queries mean: " << queries.mean() << std::endl;
+    std::cout << "queries standard deviation: " << queries.standard_deviation() << std::endl;
+  }
+
+  {
+    auto small_triangles = random_small_triangles_in_unit_cube(num_triangles);
+    bounding_box_hierarchy<triangle> bbh(small_triangles);
+
+    point eye{0.5f, 0.5f, -1.f};
+    size_t tile_size = 8;
+    auto directions = camera_ray_directions_in_tiles(256, 256, tile_size);
+
+    std::cout << "timing primary rays: " << std::endl;
+    std::cout << "bounding_box_hierarchy per ray: " << measure_per_ray_performance(bbh, eye, directions) << " rays/s" << std::endl;
+    std::cout << "bounding_box_hierarchy " << tile_size << "x" << tile_size << " tiles: " << measure_tile_performance(bbh, eye, directions, tile_size) << " rays/s" << std::endl;
+  }
+
+  {
+    auto small_triangles = random_small_triangles_in_unit_cube(num_triangles);
+
+    // a camera inside the scene, which sees only part of it
+    point eye{0.5f, 0.5f, 0.2f};
+    auto directions = camera_ray_directions_in_tiles(256, 256, 8);
+
+    // build from a sample of the camera's rays
+    std::vector<point> sample_origins;
+    std::vector<vector> sample_directions;
+    for(size_t i = 0; i < directions.size(); i += 37)
+    {
+      sample_origins.push_back(eye);
+      sample_directions.push_back(directions[i]);
+    }
+
+    bounding_box_hierarchy<triangle> sah_bbh(small_triangles);
+    bounding_box_hierarchy<triangle> rdh_bbh(small_triangles, [](const triangle& tri) { return tri.bounding_box(); },
+                                             minimize_ray_distribution_heuristic<>(sample_origins.begin(), sample_origins.end(), sample_directions.begin(), 3.f));
+
+    for(const vector& d : directions)
+    {
+      assert(rdh_bbh.intersect(eye, d, 3.f) == sah_bbh.intersect(eye, d, 3.f));
+    }
+
+    std::cout << "timing a camera's rays with hierarchies built for them: " << std::endl;
+    std::cout << "bounding_box_hierarchy with surface area heuristic: " << measure_per_ray_performance(sah_bbh, eye, directions) << " rays/s" << std::endl;
+    std::cout << "bounding_box_hierarchy with ray distribution heuristic: " << measure_per_ray_performance(rdh_bbh, eye, directions) << " rays/s" << std::endl;
+  }
+
+  {
+    // a scene too large for the cache, and rays in random order, like diffuse bounces
+    auto small_triangles = random_small_triangles_in_unit_cube(10 * num_triangles, 0.01f);
+    bounding_box_hierarchy<triangle> bbh(small_triangles);
+    auto incoherent_rays = random_rays_in_unit_cube(1 << 18);
+
+    std::cout << "timing incoherent rays: " << std::endl;
+    auto rays_per_second = measure_incoherent_performance(bbh, incoherent_rays);
+    std::cout << "bounding_box_hierarchy one ray at a time: " << rays_per_second[0] << " rays/s" << std::endl;
+    std::cout << "bounding_box_hierarchy interleaved by intersect_interleaved: " << rays_per_second[1] << " rays/s" << std::endl;
+    std::cout << "bounding_box_hierarchy sorted and interleaved by intersect_rays: " << rays_per_second[2] << " rays/s" << std::endl;
+  }
+
+  {
+    // a scene too large for the cache, and rays in random order
+    using huge_page_hierarchy = bounding_box_hierarchy<triangle,3,float,huge_page_allocator<triangle>>;
+
+    auto small_triangles = random_small_triangles_in_unit_cube(10 * num_triangles, 0.01f);
+    std::vector<triangle, huge_page_allocator<triangle>> huge_page_triangles(small_triangles.begin(), small_triangles.end());
+    auto incoherent_rays = random_rays_in_unit_cube(1 << 13);
+
+    std::cout << "timing huge pages: " << std::endl;
+    bounding_box_hierarchy<triangle> bbh(small_triangles);
+    huge_page_hierarchy huge_page_bbh(huge_page_triangles);
+    std::cout << "bounding_box_hierarchy with 4 KB pages: " << measure_performance(bbh, incoherent_rays) << " rays/s" << std::endl;
+    std::cout << "bounding_box_hierarchy with huge pages: " << measure_performance(huge_page_bbh, incoherent_rays) << " rays/s" << std::endl;
+
+    std::cout << "timing each NUMA node: " << std::endl;
+    numa_replicated_hierarchy<huge_page_hierarchy> replicated(huge_page_triangles);
+    for(size_t node = 0; node < replicated.num_replicas(); ++node)
+    {
+      double single_rays_per_second = 0;
+      double replica_rays_per_second = 0;
+
+      std::thread([&]
+      {
+        replicated.topology().bind_current_thread(node);
+
+        // the single hierarchy lives wherever the main thread first touched it
+        single_rays_per_second = measure_performance(huge_page_bbh, incoherent_rays);
+        replica_rays_per_second = measure_performance(replicated.local_replica(), incoherent_rays);
+      }).join();
+
+      std::cout << "node " << node << ": single bounding_box_hierarchy: " << single_rays_per_second << " rays/s, local replica: " << replica_rays_per_second << " rays/s" << std::endl;
+    }
+  }
+
+  {
+    // a huge scene of which a narrow camera sees only a corner
+    auto small_triangles = random_small_triangles_in_unit_cube(10 * num_triangles, 0.01f);
+
+    point eye{0.1f, 0.1f, -0.1f};
+    auto directions = camera_ray_directions_in_tiles(256, 256, 8);
+    for(vector& d : directions)
+    {
+      d = vector{0.05f * d[0], 0.05f * d[1], d[2]};
+    }
+
+    std::cout << "timing lazy_bounding_box_hierarchy: " << std::endl;
+
+    std::vector<float> results(directions.size());
+    size_t eager_first_ray_milliseconds = time_invocation_in_milliseconds(1, [&]
+    {
+      bounding_box_hierarchy<triangle> bbh(small_triangles);
+      results[0] = bbh.intersect(eye, directions[0], 3.f);
+    });
+
+    size_t lazy_first_ray_milliseconds = time_invocation_in_milliseconds(1, [&]
+    {
+      lazy_bounding_box_hierarchy<triangle> lazy(small_triangles);
+      results[0] = lazy.intersect(eye, directions[0], 3.f);
+    });
+
+    std::cout << "time to first ray: bounding_box_hierarchy: " << eager_first_ray_milliseconds << " ms, lazy_bounding_box_hierarchy: " << lazy_first_ray_milliseconds << " ms" << std::endl;
+
+    size_t eager_frame_milliseconds = time_invocation_in_milliseconds(1, [&]
+    {
+      bounding_box_hierarchy<triangle> bbh(small_triangles);
+      for(size_t i = 0; i < directions.size(); ++i)
+      {
+        results[i] = bbh.intersect(eye, directions[i], 3.f);
+      }
+    });
+
+    size_t lazy_frame_milliseconds = time_invocation_in_milliseconds(1, [&]
+    {
+      lazy_bounding_box_hierarchy<triangle> lazy(small_triangles);
+      for(size_t i = 0; i < directions.size(); ++i)
+      {
+        results[i] = lazy.intersect(eye, directions[i], 3.f);
+      }
+    });
+
+    std::cout << "building and tracing a frame: bounding_box_hierarchy: " << eager_frame_milliseconds << " ms, lazy_bounding_box_hierarchy: " << lazy_frame_milliseconds << " ms" << std::endl;
+
+    // once every placeholder has been expanded, the lazy hierarchy should be about as fast as one built up front
+    bounding_box_hierarchy<triangle> bbh(small_triangles);
+    lazy_bounding_box_hierarchy<triangle> lazy(small_triangles);
+    for(const ray& r : rays)
+    {
+      lazy.intersect(r.first, r.second, 1.f);
+    }
+    for(vector& d : directions)
+    {
+      lazy.intersect(eye, d, 3.f);
+    }
+
+    auto incoherent_rays = random_rays_in_unit_cube(1 << 13);
+    std::cout << "bounding_box_hierarchy: " << measure_performance(bbh, incoherent_rays) << " rays/s" << std::endl;
+    std::cout << "lazy_bounding_box_hierarchy: " << measure_performance(lazy, incoherent_rays) << " rays/s (" << lazy.num_nodes() << " of " << small_triangles.size() - 1 << " nodes built)" << std::endl;
+  }
+
+  {
+    auto moving_triangles = random_moving_triangles_in_unit_cube(num_triangles, 0.1f);
+
+    auto motion_rays = random_rays_in_unit_cube(1 << 14);
+
+    std::vector<std::pair<ray,float>> rays_at_times;
+    std::mt19937 rng;
+    std::uniform_real_distribution<float> unit_interval(0,1);
+    for(const ray& r : motion_rays)
+    {
+      rays_at_times.emplace_back(r, unit_interval(rng));
+    }
+
+    std::cout << "timing motion blur: " << std::endl;
+
+    // the same triangles without motion
+    std::vector<triangle> still_triangles;
+    for(const moving_triangle& tri : moving_triangles)
+    {
+      still_triangles.push_back(tri.start);
+    }
+
+    bounding_box_hierarchy<triangle> still_bbh(still_triangles);
+    std::cout << "bounding_box_hierarchy of still triangles: " << measure_performance(still_bbh, motion_rays) << " rays/s" << std::endl;
+
+    // a static hierarchy must bound everywhere each triangle goes
+    bounding_box_hierarchy<moving_triangle> swept_bbh(moving_triangles, [](const moving_triangle& tri)
+    {
+      return minimize_surface_area_heuristic::combine_bounding_boxes(tri.bounding_box(0), tri.bounding_box(1));
+    });
+
+    std::vector<float> results(rays_at_times.size());
+    size_t swept_milliseconds = time_invocation_in_milliseconds(5, [&]
+    {
+      for(size_t i = 0; i < rays_at_times.size(); ++i)
+      {
+        const ray& r = rays_at_times[i].first;
+        float time = rays_at_times[i].second;
+        results[i] = swept_bbh.intersect(r.first, r.second, 1.f, [=](const moving_triangle& tri, const point& o, const vector& d, float nearest)
+        {
+          return tri.intersect(o, d, time, nearest);
+        });
+      }
+    });
+    std::cout << "bounding_box_hierarchy of swept boxes: " << 1000 * double(motion_rays.size()) / std::max<size_t>(swept_milliseconds, 1) << " rays/s" << std::endl;
+
+    motion_bounding_box_hierarchy<moving_triangle> motion_bbh(moving_triangles);
+    size_t motion_milliseconds = time_invocation_in_milliseconds(5, [&]
+    {
+      for(size_t i = 0; i < rays_at_times.size(); ++i)
+      {
+        const ray& r = rays_at_times[i].first;
+        results[i] = motion_bbh.intersect(r.first, r.second, rays_at_times[i].second, 1.f);
+      }
+    });
+    std::cout << "motion_bounding_box_hierarchy: " << 1000 * double(motion_rays.size()) / std::max<size_t>(motion_milliseconds, 1) << " rays/s" << std::endl;
+  }
+
+  {
+    auto small_triangles = random_small_triangles_in_unit_cube(num_triangles);
+
+    std::cout << "timing dynamic_bounding_box_hierarchy: " << std::endl;
+
+    dynamic_bounding_box_hierarchy<triangle> dbbh;
+    std::vector<dynamic_bounding_box_hierarchy<triangle>::handle_type> handles(small_triangles.size());
+
+    size_t insert_nanoseconds = time_invocation_in_nanoseconds(1, [&]
+    {
+      for(size_t i = 0; i < small_triangles.size(); ++i)
+      {
+        handles[i] = dbbh.insert(small_triangles[i]);
+      }
+    });
+
+    std::cout << "dynamic_bounding_box_hierarchy insert: " << double(insert_nanoseconds) / small_triangles.size() << " ns/element" << std::endl;
+    std::cout << "dynamic_bounding_box_hierarchy: " << measure_performance(dbbh, rays) << " rays/s" << std::endl;
+
+    bounding_box_hierarchy<triangle> bbh(small_triangles);
+    std::cout << "bounding_box_hierarchy: " << measure_performance(bbh, rays) << " rays/s" << std::endl;
+
+    size_t remove_nanoseconds = time_invocation_in_nanoseconds(1, [&]
+    {
+      for(size_t i = 0; i < small_triangles.size(); i += 2)
+      {
+        dbbh.remove(handles[i]);
+      }
+    });
+
+    std::cout << "dynamic_bounding_box_hierarchy remove: " << double(remove_nanoseconds) / (small_triangles.size() / 2) << " ns/element" << std::endl;
+  }
+
+  {
+    auto small_triangles = random_small_triangles_in_unit_cube(num_triangles);
+    bounding_box_hierarchy<triangle> bbh(small_triangles);
+
+    std::cout << "timing for_each_overlapping_pair: " << std::endl;
+
+    for(size_t num_threads : {size_t(1), size_t(std::max(1u, std::thread::hardware_concurrency()))})
+    {
+      std::atomic<size_t> num_pairs{0};
+      size_t milliseconds = time_invocation_in_milliseconds(5, [&]
+      {
+        num_pairs = 0;
+        bbh.for_each_overlapping_pair([&](const triangle&, const triangle&)
+        {
+          ++num_pairs;
+        }, num_threads);
+      });
+
+      std::cout << "for_each_overlapping_pair with " << num_threads << " threads: " << num_pairs << " pairs in " << milliseconds << " ms" << std::endl;
+    }
+  }
 
   std::cout << "OK" << std::endl;
 
@@ -0,0 +1,460 @@
+#pragma once
+
+#include <vector>
+#include <array>
+#include <queue>
+#include <functional>
+#include <utility>
+#include <tuple>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#include <cstddef>
+
+#include "bounding_box_traits.hpp"
+#include "hierarchy_common.hpp"
+#include "partitioner.hpp"
+
+
+// a bounding box hierarchy which supports inserting and removing individual elements after construction
+// each edit costs time proportional to the height of the tree rather than a rebuild:
+// * new leaves are placed with a branch and bound search for the sibling which minimizes the surface area heuristic
+// * removed leaves' parents are spliced out of the tree
+// * boxes are refit along the path from the edit to the root, and tree rotations along that path keep quality from decaying
+//
+// Dimension and Scalar describe the bounding boxes of the hierarchy, as in bounding_box_hierarchy
+// Bounder computes the bounding box of each inserted element, and by default calls element.bounding_box()
+template<class T,
+         size_t Dimension = element_bounding_box_traits<T>::dimension,
+         class Scalar = typename element_bounding_box_traits<T>::scalar_type,
+         class Bounder = call_member_bounding_box>
+class dynamic_bounding_box_hierarchy
+{
+  public:
+    using element_type = T;
+
+    using bounding_box_type = typename select_bounding_box_type<T,Dimension,Scalar>::type;
+
+    using scalar_type = Scalar;
+
+    static constexpr size_t dimension = Dimension;
+
+    // identifies an inserted element until it is removed
+    using handle_type = size_t;
+
+    static_assert(bounding_box_traits<bounding_box_type>::dimension == Dimension, "bounding_box_type must have Dimension axes.");
+
+
+    explicit dynamic_bounding_box_hierarchy(Bounder bounder = Bounder())
+      : bounder_(bounder),
+        root_(null_index)
+    {}
+
+
+    template<class ContiguousRange>
+    explicit dynamic_bounding_box_hierarchy(const ContiguousRange& elements, Bounder bounder = Bounder())
+      : dynamic_bounding_box_hierarchy(bounder)
+    {
+      for(const auto& element : elements)
+      {
+        insert(element);
+      }
+    }
+
+
+    bool empty() const
+    {
+      return root_ == null_index;
+    }
+
+
+    bounding_box_type bounding_box() const
+    {
+      return empty() ? minimize_surface_area_heuristic::empty_box<bounding_box_type>() : nodes_[root_].bounding_box_;
+    }
+
+
+    const T& operator[](handle_type handle) const
+    {
+      return elements_[nodes_[handle].element_];
+    }
+
+
+    // inserts element into the hierarchy using the bounder's box as its bounding box
+    handle_type insert(const T& element)
+    {
+      return insert(element, bounder_(element));
+    }
+
+
+    // inserts element into the hierarchy and returns a handle which may be used to remove it later
+    handle_type insert(const T& element, const bounding_box_type& box)
+    {
+      handle_type leaf = allocate_node();
+      nodes_[leaf].bounding_box_ = box;
+      nodes_[leaf].element_ = allocate_element(element);
+
+      insert_leaf(leaf);
+
+      return leaf;
+    }
+
+
+    // removes the element identified by handle from the hierarchy
+    // handle is invalidated
+    void remove(handle_type handle)
+    {
+      remove_leaf(handle);
+
+      free_element(nodes_[handle].element_);
+      free_node(handle);
+    }
+
+
+    template<class Point, class Vector, class U,
+             class Function1 = call_member_intersect,
+             class Function2 = default_projection<Scalar>>
+    U intersect(Point origin, Vector direction, U init,
+                Function1 intersector = call_member_intersect(),
+                Function2 hit_time = default_projection<Scalar>()) const
+    {
+      U result = init;
+      auto result_t = hit_time(result);
+
+      if(empty())
+      {
+        return result;
+      }
+
+      Vector one_over_direction;
+      std::array<bool,Dimension> is_negative;
+      for_each_axis<Dimension>([&](auto axis)
+      {
+        one_over_direction[axis] = Scalar(1) / direction[axis];
+        is_negative[axis] = std::signbit(direction[axis]);
+      });
+
+      growable_stack<size_t,64> stack;
+      stack.push(root_);
+
+      while(!stack.empty())
+      {
+        const node& current_node = nodes_[stack.pop()];
+
+        if(!intersect_box(current_node.bounding_box_, origin, one_over_direction, is_negative, result_t))
+        {
+          continue;
+        }
+
+        if(current_node.is_leaf())
+        {
+          auto current_result = intersector(elements_[current_node.element_], origin, direction, result);
+          auto current_t = hit_time(current_result);
+          if(current_t < result_t)
+          {
+            result_t = current_t;
+            result = current_result;
+          }
+        }
+        else
+        {
+          // push children to stack
+          stack.push(current_node.left_child_);
+          stack.push(current_node.right_child_);
+        }
+      }
+
+      return result;
+    }
+
+
+  private:
+    static constexpr size_t null_index = std::numeric_limits<size_t>::max();
+
+
+    struct node
+    {
+      bounding_box_type bounding_box_;
+      size_t parent_;
+      size_t left_child_;
+      size_t right_child_;
+
+      // for leaves, the index of the element in elements_
+      // for free nodes, the index of the next free node
+      size_t element_;
+
+      bool is_leaf() const
+      {
+        return left_child_ == null_index;
+      }
+    };
+
+
+    static bounding_box_type combine(const bounding_box_type& a, const bounding_box_type& b)
+    {
+      return minimize_surface_area_heuristic::combine_bounding_boxes(a, b);
+    }
+
+
+    static Scalar surface_area(const bounding_box_type& box)
+    {
+      return minimize_surface_area_heuristic::surface_area(box);
+    }
+
+
+    size_t allocate_node()
+    {
+      size_t result;
+
+      if(free_nodes_ != null_index)
+      {
+        result = free_nodes_;
+        free_nodes_ = nodes_[result].element_;
+      }
+      else
+      {
+        result = nodes_.size();
+        nodes_.emplace_back();
+      }
+
+      nodes_[result].parent_ = null_index;
+      nodes_[result].left_child_ = null_index;
+      nodes_[result].right_child_ = null_index;
+      nodes_[result].element_ = null_index;
+
+      return result;
+    }
+
+
+    void free_node(size_t n)
+    {
+      nodes_[n].element_ = free_nodes_;
+      free_nodes_ = n;
+    }
+
+
+    size_t allocate_element(const T& element)
+    {
+      if(free_elements_.empty())
+      {
+        elements_.push_back(element);
+        return elements_.size() - 1;
+      }
+
+      size_t result = free_elements_.back();
+      free_elements_.pop_back();
+      elements_[result] = element;
+      return result;
+    }
+
+
+    void free_element(size_t e)
+    {
+      free_elements_.push_back(e);
+    }
+
+
+    // finds the node whose sibling leaf should become to minimize the surface area heuristic
+    // this is the branch and bound search of Bittner et al. 2012: the cost of making a node the sibling is the
+    // area of its box enlarged by the leaf plus the enlargement of each of its ancestors' boxes
+    size_t find_best_sibling(const bounding_box_type& box) const
+    {
+      Scalar leaf_area = surface_area(box);
+
+      size_t best_sibling = root_;
+      Scalar best_cost = surface_area(combine(nodes_[root_].bounding_box_, box));
+
+      // queue nodes by the cost inherited from their ancestors, cheapest first
+      using entry = std::pair<Scalar,size_t>;
+      std::priority_queue<entry, std::vector<entry>, std::greater<entry>> queue;
+      queue.push(entry(Scalar(0), root_));
+
+      while(!queue.empty())
+      {
+        Scalar inherited_cost = queue.top().first;
+        size_t current = queue.top().second;
+        queue.pop();
+
+        const node& current_node = nodes_[current];
+
+        Scalar direct_cost = surface_area(combine(current_node.bounding_box_, box));
+        Scalar cost = direct_cost + inherited_cost;
+
+        if(cost < best_cost)
+        {
+          best_cost = cost;
+          best_sibling = current;
+        }
+
+        if(!current_node.is_leaf())
+        {
+          // descendants inherit this node's enlargement
+          Scalar child_inherited_cost = inherited_cost + direct_cost - surface_area(current_node.bounding_box_);
+
+          // a descendant's cost can never be lower than the area of the leaf itself plus what it inherits
+          if(leaf_area + child_inherited_cost < best_cost)
+          {
+            queue.push(entry(child_inherited_cost, current_node.left_child_));
+            queue.push(entry(child_inherited_cost, current_node.right_child_));
+          }
+        }
+      }
+
+      return best_sibling;
+    }
+
+
+    void insert_leaf(size_t leaf)
+    {
+      if(empty())
+      {
+        root_ = leaf;
+        return;
+      }
+
+      size_t sibling = find_best_sibling(nodes_[leaf].bounding_box_);
+      size_t old_parent = nodes_[sibling].parent_;
+
+      // create a new parent for the sibling and the leaf
+      size_t new_parent = allocate_node();
+      nodes_[new_parent].parent_ = old_parent;
+      nodes_[new_parent].left_child_ = sibling;
+      nodes_[new_parent].right_child_ = leaf;
+      nodes_[new_parent].bounding_box_ = combine(nodes_[sibling].bounding_box_, nodes_[leaf].bounding_box_);
+
+      nodes_[sibling].parent_ = new_parent;
+      nodes_[leaf].parent_ = new_parent;
+
+      if(old_parent == null_index)
+      {
+        root_ = new_parent;
+      }
+      else
+      {
+        replace_child(old_parent, sibling, new_parent);
+      }
+
+      refit_and_rotate(old_parent);
+    }
+
+
+    void remove_leaf(size_t leaf)
+    {
+      if(leaf == root_)
+      {
+        root_ = null_index;
+        return;
+      }
+
+      size_t parent = nodes_[leaf].parent_;
+      size_t grandparent = nodes_[parent].parent_;
+      size_t sibling = nodes_[parent].left_child_ == leaf ? nodes_[parent].right_child_ : nodes_[parent].left_child_;
+
+      // splice the parent out of the tree
+      nodes_[sibling].parent_ = grandparent;
+
+      if(grandparent == null_index)
+      {
+        root_ = sibling;
+      }
+      else
+      {
+        replace_child(grandparent, parent, sibling);
+      }
+
+      free_node(parent);
+
+      refit_and_rotate(grandparent);
+    }
+
+
+    void replace_child(size_t parent, size_t old_child, size_t new_child)
+    {
+      if(nodes_[parent].left_child_ == old_child)
+      {
+        nodes_[parent].left_child_ = new_child;
+      }
+      else
+      {
+        nodes_[parent].right_child_ = new_child;
+      }
+    }
+
+
+    void refit(size_t n)
+    {
+      node& current_node = nodes_[n];
+      current_node.bounding_box_ = combine(nodes_[current_node.left_child_].bounding_box_, nodes_[current_node.right_child_].bounding_box_);
+    }
+
+
+    // walks from n to the root, refitting each node's box and rotating its subtrees when that lowers the tree's cost
+    void refit_and_rotate(size_t n)
+    {
+      while(n != null_index)
+      {
+        refit(n);
+        rotate(n);
+        n = nodes_[n].parent_;
+      }
+    }
+
+
+    // considers swapping each child of n with each grandchild on the other side, following Kopta et al. 2012
+    // the swap which most reduces the area of the affected child's box is applied
+    void rotate(size_t n)
+    {
+      size_t left = nodes_[n].left_child_;
+      size_t right = nodes_[n].right_child_;
+
+      size_t best_child = null_index;
+      size_t best_grandchild = null_index;
+      Scalar best_cost_reduction = 0;
+
+      auto consider = [&](size_t child, size_t other_child)
+      {
+        if(nodes_[other_child].is_leaf()) return;
+
+        size_t grandchildren[2] = {nodes_[other_child].left_child_, nodes_[other_child].right_child_};
+
+        for(int i = 0; i < 2; ++i)
+        {
+          // swapping child with grandchildren[i] leaves other_child over child and grandchildren[1-i]
+          Scalar area_after = surface_area(combine(nodes_[child].bounding_box_, nodes_[grandchildren[1-i]].bounding_box_));
+          Scalar cost_reduction = surface_area(nodes_[other_child].bounding_box_) - area_after;
+
+          if(cost_reduction > best_cost_reduction)
+          {
+            best_cost_reduction = cost_reduction;
+            best_child = child;
+            best_grandchild = grandchildren[i];
+          }
+        }
+      };
+
+      consider(left, right);
+      consider(right, left);
+
+      if(best_child != null_index)
+      {
+        size_t other_child = nodes_[best_grandchild].parent_;
+
+        replace_child(n, best_child, best_grandchild);
+        nodes_[best_grandchild].parent_ = n;
+
+        replace_child(other_child, best_grandchild, best_child);
+        nodes_[best_child].parent_ = other_child;
+
+        refit(other_child);
+      }
+    }
+
+
+    Bounder bounder_;
+    std::vector<node> nodes_;
+    std::vector<T> elements_;
+    std::vector<size_t> free_elements_;
+    size_t free_nodes_ = null_index;
+    size_t root_;
+};
+
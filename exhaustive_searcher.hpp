@@ -1,78 +1,33 @@
 #pragma once
 
 #include <utility>
-#include <tuple>
 #include <array>
 #include <limits>
+#include <algorithm>
+#include <cstddef>
 
+#include "bounding_box_traits.hpp"
+#include "hierarchy_common.hpp"
 
-template<class T>
+
+template<class T,
+         size_t Dimension = element_bounding_box_traits<T>::dimension,
+         class Scalar = typename element_bounding_box_traits<T>::scalar_type>
 class exhaustive_searcher
 {
-  private:
-    struct call_member_intersect
-    {
-      template<class... Args>
-      auto operator()(const T& element, Args&&... args) const
-      {
-        return element.intersect(std::forward<Args>(args)...);
-      }
-    };
-
-
-    struct call_member_bounding_box
-    {
-      auto operator()(const T& element) const
-      {
-        return element.bounding_box();
-      }
-    };
-
-
-    struct default_projection
-    {
-      float operator()(float x) const
-      {
-        return x;
-      }
-
-      template<class... Types>
-      auto operator()(const std::tuple<Types...>& t) const
-      {
-        return std::get<float>(t);
-      }
-
-      template<class T1, class T2>
-      auto operator()(const std::pair<T1,T2>& p) const
-      {
-        return std::get<float>(p);
-      }
-    };
-
-
-    struct select_bounding_box_type
-    {
-      // if U::bounding_box() exists, use its type as the bounding box type
-      template<class U>
-      static auto test(int) -> decltype(std::declval<U>().bounding_box());
-
-      // otherwise, a bounding box is an array of two arrays of three floats
-      template<class>
-      static std::array<std::array<float,3>,2> test(...);
-
-      using type = decltype(test<T>(0));
-    };
-
-
   public:
     using element_type = T;
 
-    using bounding_box_type = typename select_bounding_box_type::type;
+    using bounding_box_type = typename select_bounding_box_type<T,Dimension,Scalar>::type;
+
+    using scalar_type = Scalar;
+
+    static constexpr size_t dimension = Dimension;
 
     template<class ContiguousRange, class Bounder = call_member_bounding_box>
     exhaustive_searcher(const ContiguousRange& elements,
                         Bounder bounder = call_member_bounding_box(),
-                        float epsilon = std::numeric_limits<float>::epsilon())
+                        Scalar epsilon = std::numeric_limits<Scalar>::epsilon())
       : begin_(&*elements.begin()),
         end_(&*elements.end()),
         bounding_box_(bounding_box(elements, bounder, epsilon))
@@ -85,10 +40,10 @@ class exhaustive_searcher
 
     template<class Point, class Vector, class U,
              class Function1 = call_member_intersect,
-             class Function2 = default_projection>
+             class Function2 = default_projection<Scalar>>
     U intersect(Point origin, Vector direction, U init,
                 Function1 intersector = call_member_intersect(),
-                Function2 hit_time = default_projection()) const
+                Function2 hit_time = default_projection<Scalar>()) const
     {
       U result = init;
       auto result_t = hit_time(result);
@@ -108,33 +63,62 @@ class exhaustive_searcher
       return result;
     }
 
+    // calls callback(element) for each element whose bounding box overlaps region
+    // region is a bounding box, or any type for which overlaps(region, box) tests overlap with a bounding box
+    // by default, overlaps calls region.overlaps(box) if it exists
+    // if callback returns false, the query stops early. returns false if the query was stopped early
+    // elements are tested against the bounding boxes given by bounder
+    template<class Region, class Function,
+             class OverlapTest = call_member_overlaps,
+             class Bounder = call_member_bounding_box>
+    bool query_overlaps(const Region& region, Function callback,
+                        OverlapTest overlaps = call_member_overlaps(),
+                        Bounder bounder = call_member_bounding_box()) const
+    {
+      for(const T* element = begin_; element != end_; ++element)
+      {
+        if(overlaps(region, bounder(*element)) && !invoke_callback(callback, *element, 0))
+        {
+          return false;
+        }
+      }
+
+      return true;
+    }
+
   private:
     template<class ContiguousRange, class Bounder>
-    static bounding_box_type bounding_box(const ContiguousRange& elements, Bounder bounder, float epsilon)
+    static bounding_box_type bounding_box(const ContiguousRange& elements, Bounder bounder, Scalar epsilon)
     {
-      float inf = std::numeric_limits<float>::infinity();
-      bounding_box_type result{{{inf, inf, inf}, {-inf, -inf, -inf}}};
-          
+      Scalar inf = std::numeric_limits<Scalar>::infinity();
+
+      bounding_box_type result;
+      for_each_axis<Dimension>([&](auto i)
+      {
+        result[0][i] =  inf;
+        result[1][i] = -inf;
+      });
+
       for(const auto& element : elements)
       {
         auto bounding_box = bounder(element);
 
-        for(int i = 0; i < 3; ++i)
+        for_each_axis<Dimension>([&](auto i)
         {
           result[0][i] = std::min(result[0][i], bounding_box[0][i]);
           result[1][i] = std::max(result[1][i], bounding_box[1][i]);
-        }
+        });
       }
 
       // widen the bounding box by 2*epsilon
       // XXX might want to instead ensure that each side is at least epsilon in width
       // this ensures that axis-aligned elements always
       // lie strictly within the bounding box
-      for(size_t i = 0; i != 3; ++i)
+      for_each_axis<Dimension>([&](auto i)
       {
         result[0][i] -= epsilon;
         result[1][i] += epsilon;
-      }
+      });
 
       return result;
     }
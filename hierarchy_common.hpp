@@ -0,0 +1,232 @@
+#pragma once
+
+#include <array>
+#include <vector>
+#include <tuple>
+#include <limits>
+#include <utility>
+#include <cstddef>
+
+#include "bounding_box_traits.hpp"
+
+
+// helpers shared by the hierarchies and searchers
+
+
+// the default intersector, which calls element.intersect(args...)
+struct call_member_intersect
+{
+  template<class T, class... Args>
+  auto operator()(const T& element, Args&&... args) const
+  {
+    return element.intersect(std::forward<Args>(args)...);
+  }
+};
+
+
+// the default bounder, which calls element.bounding_box()
+struct call_member_bounding_box
+{
+  template<class T>
+  auto operator()(const T& element) const
+  {
+    return element.bounding_box();
+  }
+};
+
+
+// the default hit_time, which projects an intersection result to the time at which it was hit
+// a Scalar is its own hit time, and the hit time of a tuple or a pair is its Scalar member
+template<class Scalar>
+struct default_projection
+{
+  Scalar operator()(Scalar x) const
+  {
+    return x;
+  }
+
+  template<class... Types>
+  auto operator()(const std::tuple<Types...>& t) const
+  {
+    return std::get<Scalar>(t);
+  }
+
+  template<class T1, class T2>
+  auto operator()(const std::pair<T1,T2>& p) const
+  {
+    return std::get<Scalar>(p);
+  }
+};
+
+
+// tests whether a region overlaps a bounding box
+// if Region::overlaps(box) exists, call it. otherwise, the region is itself a bounding box
+struct call_member_overlaps
+{
+  template<class Region, class BoundingBox>
+  static auto test(const Region& region, const BoundingBox& box, int) -> decltype(region.overlaps(box))
+  {
+    return region.overlaps(box);
+  }
+
+  template<class Region, class BoundingBox>
+  static bool test(const Region& region, const BoundingBox& box, ...)
+  {
+    bool result = true;
+    for_each_axis<bounding_box_traits<BoundingBox>::dimension>([&](auto axis)
+    {
+      result &= (region[0][axis] <= box[1][axis]) & (box[0][axis] <= region[1][axis]);
+    });
+
+    return result;
+  }
+
+  template<class Region, class BoundingBox>
+  bool operator()(const Region& region, const BoundingBox& box) const
+  {
+    return test(region, box, 0);
+  }
+};
+
+
+// calls f(element) and returns false if f asked to stop by returning false
+template<class Function, class T>
+inline auto invoke_callback(Function& f, const T& element, int) -> decltype(bool(f(element)))
+{
+  return f(element);
+}
+
+template<class Function, class T>
+inline bool invoke_callback(Function& f, const T& element, ...)
+{
+  f(element);
+  return true;
+}
+
+
+// if T::bounding_box() exists, the type of its result
+// otherwise, an array of two arrays of Dimension Scalars
+template<class T, std::size_t Dimension, class Scalar>
+struct select_bounding_box_type
+{
+  private:
+    template<class U>
+    static auto test(int) -> decltype(std::declval<U>().bounding_box());
+
+    template<class>
+    static std::array<std::array<Scalar,Dimension>,2> test(...);
+
+  public:
+    using type = decltype(test<T>(0));
+};
+
+
+// during construction, hierarchies partition an array of references to elements rather than the elements themselves
+// each reference caches its element's bounding box and centroid, so partitioning streams through a compact array
+// rather than chasing indices into the elements and recomputing centroids at every level of the tree
+template<class BoundingBox>
+struct primitive_reference
+{
+  using traits = bounding_box_traits<BoundingBox>;
+
+  BoundingBox bounding_box_;
+  std::array<typename traits::scalar_type,traits::dimension> centroid_;
+  std::size_t index_;
+};
+
+
+// a bounder of primitive_references, which partitioners use like any other bounder
+// because it has a member function .centroid(), partitioners use the cached centroid rather than recomputing it
+struct reference_bounder
+{
+  template<class BoundingBox>
+  const BoundingBox& operator()(const primitive_reference<BoundingBox>& ref) const
+  {
+    return ref.bounding_box_;
+  }
+
+  template<class BoundingBox>
+  const auto& centroid(const primitive_reference<BoundingBox>& ref) const
+  {
+    return ref.centroid_;
+  }
+};
+
+
+// returns whether the ray origin + t * direction hits box for some t in [0, t_bound)
+// is_negative[axis] is whether direction[axis] is negative
+template<class BoundingBox, class Point, class Vector, std::size_t Dimension, class TimeType>
+inline bool intersect_box(const BoundingBox& box,
+                          const Point& origin,
+                          const Vector& one_over_direction,
+                          const std::array<bool,Dimension>& is_negative,
+                          TimeType t_bound)
+{
+  using scalar_type = typename bounding_box_traits<BoundingBox>::scalar_type;
+
+  scalar_type tmin = -std::numeric_limits<scalar_type>::infinity();
+  scalar_type tmax =  std::numeric_limits<scalar_type>::infinity();
+
+  // intersect the ray's interval with each axis' slab
+  for_each_axis<Dimension>([&](auto axis)
+  {
+    scalar_type axis_tmin = (box[is_negative[axis]][axis] - origin[axis]) * one_over_direction[axis];
+    scalar_type axis_tmax = (box[1 - is_negative[axis]][axis] - origin[axis]) * one_over_direction[axis];
+
+    if(axis_tmin > tmin) tmin = axis_tmin;
+    if(axis_tmax < tmax) tmax = axis_tmax;
+  });
+
+  return tmin <= tmax && tmin < t_bound && tmax >= scalar_type(0);
+}
+
+
+// a stack which lives on the call stack until it grows beyond N elements
+// traversal stacks are growable because the depth of a tree depends on its partitioner and its elements
+template<class T, std::size_t N>
+class growable_stack
+{
+  public:
+    growable_stack()
+      : size_(0)
+    {}
+
+    void push(const T& value)
+    {
+      if(size_ < N)
+      {
+        inline_storage_[size_] = value;
+      }
+      else
+      {
+        overflow_storage_.push_back(value);
+      }
+
+      ++size_;
+    }
+
+    T pop()
+    {
+      --size_;
+
+      if(size_ < N)
+      {
+        return inline_storage_[size_];
+      }
+
+      T result = overflow_storage_.back();
+      overflow_storage_.pop_back();
+      return result;
+    }
+
+    bool empty() const
+    {
+      return size_ == 0;
+    }
+
+  private:
+    std::size_t size_;
+    std::array<T,N> inline_storage_;
+    std::vector<T> overflow_storage_;
+};
+
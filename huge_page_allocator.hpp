@@ -0,0 +1,130 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+
+enum class huge_page_policy
+{
+  // ask the kernel to back the allocation with transparent huge pages where it can
+  transparent,
+
+  // map pages from the pool reserved in /proc/sys/vm/nr_hugepages, or fall back to transparent huge pages if the pool is empty
+  explicit_pages
+};
+
+
+// an allocator whose large allocations are backed by 2 MB pages rather than 4 KB pages, so that traversing
+// a multi-gigabyte hierarchy misses in the TLB far less often
+// small allocations, and allocations on platforms other than linux, use operator new
+// pages are placed on the NUMA node of the thread which first touches them, like any other memory
+template<class T, huge_page_policy Policy = huge_page_policy::transparent>
+class huge_page_allocator
+{
+  public:
+    using value_type = T;
+
+    template<class U>
+    struct rebind
+    {
+      using other = huge_page_allocator<U,Policy>;
+    };
+
+    static constexpr std::size_t huge_page_size = std::size_t(2) << 20;
+
+
+    huge_page_allocator() = default;
+
+
+    template<class U>
+    huge_page_allocator(const huge_page_allocator<U,Policy>&) {}
+
+
+    T* allocate(std::size_t n)
+    {
+      if(n > std::size_t(-1) / sizeof(T))
+      {
+        throw std::bad_array_new_length();
+      }
+
+      std::size_t num_bytes = n * sizeof(T);
+
+#ifdef __linux__
+      if(num_bytes >= huge_page_size)
+      {
+        std::size_t length = mapped_length(num_bytes);
+        void* result = MAP_FAILED;
+
+        if(Policy == huge_page_policy::explicit_pages)
+        {
+          result = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        }
+
+        if(result == MAP_FAILED)
+        {
+          // transparent huge pages must be aligned to huge pages, so map an extra huge page and trim the ends
+          char* mapping = static_cast<char*>(mmap(nullptr, length + huge_page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+          if(mapping == MAP_FAILED)
+          {
+            throw std::bad_alloc();
+          }
+
+          char* aligned = mapping + (huge_page_size - reinterpret_cast<std::uintptr_t>(mapping) % huge_page_size) % huge_page_size;
+          if(aligned != mapping) munmap(mapping, aligned - mapping);
+          if(aligned != mapping + huge_page_size) munmap(aligned + length, mapping + huge_page_size - aligned);
+
+          madvise(aligned, length, MADV_HUGEPAGE);
+          result = aligned;
+        }
+
+        return static_cast<T*>(result);
+      }
+#endif
+
+      return static_cast<T*>(::operator new(num_bytes));
+    }
+
+
+    void deallocate(T* ptr, std::size_t n)
+    {
+      std::size_t num_bytes = n * sizeof(T);
+
+#ifdef __linux__
+      if(num_bytes >= huge_page_size)
+      {
+        munmap(ptr, mapped_length(num_bytes));
+        return;
+      }
+#endif
+
+      ::operator delete(ptr);
+    }
+
+
+  private:
+    // mappings are whole huge pages
+    static std::size_t mapped_length(std::size_t num_bytes)
+    {
+      return (num_bytes + huge_page_size - 1) / huge_page_size * huge_page_size;
+    }
+};
+
+
+template<class T1, class T2, huge_page_policy Policy>
+bool operator==(const huge_page_allocator<T1,Policy>&, const huge_page_allocator<T2,Policy>&)
+{
+  return true;
+}
+
+
+template<class T1, class T2, huge_page_policy Policy>
+bool operator!=(const huge_page_allocator<T1,Policy>&, const huge_page_allocator<T2,Policy>&)
+{
+  return false;
+}
+
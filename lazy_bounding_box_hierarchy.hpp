@@ -0,0 +1,383 @@
+#pragma once
+
+#include <vector>
+#include <array>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <cstddef>
+
+#include "bounding_box_traits.hpp"
+#include "hierarchy_common.hpp"
+#include "partitioner.hpp"
+
+
+// a bounding box hierarchy which builds its subtrees on demand, for huge scenes whose rays touch only part of the geometry
+// construction builds the top levels of the tree and leaves placeholder nodes over the unsplit elements beneath them.
+// the first query to reach a placeholder expands it by a few more levels with Partitioner, leaving new placeholders below,
+// so subtrees which no ray reaches are never built
+//
+// thread safety: queries expand placeholders, but the const member functions may still be called concurrently from any
+// number of threads. each placeholder is expanded by one of the threads which reach it while the others wait for it,
+// and expanded nodes never change. like bounding_box_hierarchy, the hierarchy refers to the elements it was built from
+// without owning them, so they must outlive it and must not be modified while it is queried
+template<class T,
+         size_t Dimension = element_bounding_box_traits<T>::dimension,
+         class Scalar = typename element_bounding_box_traits<T>::scalar_type,
+         class Partitioner = minimize_surface_area_heuristic>
+class lazy_bounding_box_hierarchy
+{
+  public:
+    using element_type = T;
+
+    using bounding_box_type = typename select_bounding_box_type<T,Dimension,Scalar>::type;
+
+    using scalar_type = Scalar;
+
+    using partitioner_type = Partitioner;
+
+    static constexpr size_t dimension = Dimension;
+
+    static constexpr size_t default_levels_per_expansion = 6;
+
+    static_assert(bounding_box_traits<bounding_box_type>::dimension == Dimension, "bounding_box_type must have Dimension axes.");
+
+
+    // construction builds the top levels_per_expansion levels of the tree, and each expansion of a placeholder builds
+    // levels_per_expansion more. the bounder is only called during construction, but partitioner is kept for expansions
+    // a hierarchy of no elements has no root and an empty bounding box, and its queries return init
+    template<class ContiguousRange, class Bounder = call_member_bounding_box>
+    lazy_bounding_box_hierarchy(const ContiguousRange& elements,
+                                Bounder bounder = call_member_bounding_box(),
+                                Partitioner partitioner = Partitioner(),
+                                size_t levels_per_expansion = default_levels_per_expansion)
+      : elements_(elements.begin() == elements.end() ? nullptr : &*elements.begin()),
+        num_elements_(elements.end() - elements.begin()),
+        partitioner_(partitioner),
+        levels_per_expansion_(std::max<size_t>(levels_per_expansion, 1)),
+        references_(num_elements_),
+        num_nodes_(0)
+    {
+      for(size_t i = 0; i < num_elements_; ++i)
+      {
+        primitive_reference& ref = references_[i];
+        ref.bounding_box_ = bounder(elements_[i]);
+        ref.centroid_ = partition_largest_axis_at_middle_element::centroid(ref.bounding_box_);
+        ref.index_ = i;
+      }
+
+      bounding_box_ = bounding_box(references_.begin(), references_.end());
+
+      if(num_elements_ == 0)
+      {
+        root_ = nullptr;
+        return;
+      }
+
+      if(num_elements_ == 1)
+      {
+        root_ = leaf(0);
+        return;
+      }
+
+      // the root begins as a placeholder over every element
+      std::unique_ptr<node[]> block(new node[1]);
+      block[0].bounding_box_ = bounding_box_;
+      block[0].first_ = 0;
+      block[0].last_ = num_elements_;
+      block[0].state_.store(placeholder, std::memory_order_relaxed);
+
+      root_ = block.get();
+      blocks_.push_back(std::move(block));
+      num_nodes_ = 1;
+
+      expand(root_);
+    }
+
+
+    bounding_box_type bounding_box() const
+    {
+      return bounding_box_;
+    }
+
+
+    // the number of nodes built so far, including placeholders
+    size_t num_nodes() const
+    {
+      return num_nodes_.load(std::memory_order_relaxed);
+    }
+
+
+    // as bounding_box_hierarchy::intersect(), but expands the placeholders whose boxes the ray hits
+    template<class Point, class Vector, class U,
+             class Function1 = call_member_intersect,
+             class Function2 = default_projection<Scalar>>
+    U intersect(Point origin, Vector direction, U init,
+                Function1 intersector = call_member_intersect(),
+                Function2 hit_time = default_projection<Scalar>()) const
+    {
+      U result = init;
+      auto result_t = hit_time(result);
+
+      if(!root_)
+      {
+        return result;
+      }
+
+      Vector one_over_direction;
+      std::array<bool,Dimension> is_negative;
+      for_each_axis<Dimension>([&](auto axis)
+      {
+        one_over_direction[axis] = Scalar(1) / direction[axis];
+        is_negative[axis] = std::signbit(direction[axis]);
+      });
+
+      growable_stack<const node*,64> stack;
+      stack.push(root_);
+
+      while(!stack.empty())
+      {
+        const node* current_node = stack.pop();
+
+        if(is_leaf(current_node))
+        {
+          auto current_result = intersector(element(current_node), origin, direction, result);
+          auto current_t = hit_time(current_result);
+          if(current_t < result_t)
+          {
+            result_t = current_t;
+            result = current_result;
+          }
+        }
+        else
+        {
+          if(intersect_box(current_node->bounding_box_, origin, one_over_direction, is_negative, result_t))
+          {
+            if(current_node->state_.load(std::memory_order_acquire) != expanded)
+            {
+              expand(current_node);
+            }
+
+            // push children to stack
+            stack.push(current_node->left_child_);
+            stack.push(current_node->right_child_);
+          }
+        }
+      }
+
+      return result;
+    }
+
+
+  private:
+    // a placeholder has no children yet. a node being expanded is still a placeholder to every thread but the one expanding it
+    enum : int
+    {
+      placeholder,
+      expanding,
+      expanded
+    };
+
+
+    struct node
+    {
+      bounding_box_type bounding_box_;
+
+      // a placeholder's elements are those referred to by references_[first_, last_)
+      // expanding the placeholder replaces them with its children, which keeps nodes as small as possible
+      union
+      {
+        size_t first_;
+        const node* left_child_;
+      };
+
+      union
+      {
+        size_t last_;
+        const node* right_child_;
+      };
+
+      // a node's children may only be read after its state_ has been loaded as expanded
+      std::atomic<int> state_;
+    };
+
+
+    // as in bounding_box_hierarchy, the partitioner partitions references which cache their elements' boxes and centroids
+    // expansions partition disjoint ranges of references, so they may run concurrently
+    using primitive_reference = ::primitive_reference<bounding_box_type>;
+
+
+    template<class Iterator>
+    static bounding_box_type bounding_box(Iterator begin, Iterator end)
+    {
+      bounding_box_type result = minimize_surface_area_heuristic::empty_box<bounding_box_type>();
+
+      for(Iterator ref = begin; ref != end; ++ref)
+      {
+        result = minimize_surface_area_heuristic::combine_bounding_boxes(result, ref->bounding_box_);
+      }
+
+      return result;
+    }
+
+
+    // expands the placeholder n, or waits for the thread which is already expanding it
+    void expand(const node* n) const
+    {
+      // every node is created non-const in a block, so the placeholder may be modified
+      node& target = const_cast<node&>(*n);
+
+      while(true)
+      {
+        int state = target.state_.load(std::memory_order_acquire);
+        if(state == expanded) return;
+
+        if(state == placeholder && target.state_.compare_exchange_strong(state, expanding, std::memory_order_acquire))
+        {
+          std::unique_ptr<node[]> block;
+          try
+          {
+            block = build_subtree(target);
+          }
+          catch(...)
+          {
+            // let another thread try again
+            {
+              std::lock_guard<std::mutex> lock(mutex_);
+              target.state_.store(placeholder, std::memory_order_release);
+            }
+            expansion_finished_.notify_all();
+            throw;
+          }
+
+          {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if(block) blocks_.push_back(std::move(block));
+            target.state_.store(expanded, std::memory_order_release);
+          }
+          expansion_finished_.notify_all();
+          return;
+        }
+
+        // another thread is expanding the placeholder
+        std::unique_lock<std::mutex> lock(mutex_);
+        expansion_finished_.wait(lock, [&]
+        {
+          return target.state_.load(std::memory_order_acquire) != expanding;
+        });
+      }
+    }
+
+
+    // builds levels_per_expansion_ levels beneath the placeholder n and returns the block of new nodes
+    std::unique_ptr<node[]> build_subtree(node& n) const
+    {
+      size_t num_elements = n.last_ - n.first_;
+
+      // a subtree of num_elements elements has at most num_elements - 1 nodes, one of which is n,
+      // and levels_per_expansion_ levels beneath n have at most 2^(levels_per_expansion_ + 1) - 2 nodes
+      size_t max_num_nodes = num_elements - 2;
+      if(levels_per_expansion_ + 1 < size_t(std::numeric_limits<size_t>::digits))
+      {
+        max_num_nodes = std::min(max_num_nodes, (size_t(2) << levels_per_expansion_) - 2);
+      }
+
+      std::unique_ptr<node[]> block;
+      if(max_num_nodes > 0)
+      {
+        block.reset(new node[max_num_nodes]);
+      }
+
+      // partitioners may keep state from one node to its children, so each expansion partitions with its own copy
+      size_t num_nodes = 0;
+      build_recursive(n, levels_per_expansion_, partitioner_, block.get(), num_nodes);
+      num_nodes_.fetch_add(num_nodes, std::memory_order_relaxed);
+
+      return block;
+    }
+
+
+    void build_recursive(node& n, size_t levels, Partitioner partitioner, node* block, size_t& num_nodes) const
+    {
+      auto first = references_.begin() + n.first_;
+      auto last  = references_.begin() + n.last_;
+
+      // partition the elements into two sets
+      auto split = partitioner(first, last, n.bounding_box_, reference_bounder());
+
+      std::array<size_t,3> bounds = {{n.first_, size_t(split - references_.begin()), n.last_}};
+      std::array<const node*,2> children;
+
+      for(size_t i = 0; i < 2; ++i)
+      {
+        if(bounds[i] + 1 == bounds[i + 1])
+        {
+          // we've hit a leaf, so refer to the element
+          children[i] = leaf(references_[bounds[i]].index_);
+        }
+        else
+        {
+          node& child = block[num_nodes++];
+          child.bounding_box_ = bounding_box(references_.begin() + bounds[i], references_.begin() + bounds[i + 1]);
+          child.first_ = bounds[i];
+          child.last_ = bounds[i + 1];
+
+          // nodes built by this expansion are published along with n
+          if(levels > 1)
+          {
+            build_recursive(child, levels - 1, partitioner, block, num_nodes);
+            child.state_.store(expanded, std::memory_order_relaxed);
+          }
+          else
+          {
+            child.state_.store(placeholder, std::memory_order_relaxed);
+          }
+
+          children[i] = &child;
+        }
+      }
+
+      n.left_child_ = children[0];
+      n.right_child_ = children[1];
+    }
+
+
+    // as in bounding_box_hierarchy, a leaf is a pointer to its element
+    const node* leaf(size_t index) const
+    {
+      return reinterpret_cast<const node*>(elements_ + index);
+    }
+
+    bool is_leaf(const node* n) const
+    {
+      const T* e = reinterpret_cast<const T*>(n);
+      return elements_ <= e && e < elements_ + num_elements_;
+    }
+
+    const T& element(const node* leaf) const
+    {
+      return *reinterpret_cast<const T*>(leaf);
+    }
+
+
+    const T* elements_;
+    size_t num_elements_;
+    Partitioner partitioner_;
+    size_t levels_per_expansion_;
+    bounding_box_type bounding_box_;
+    const node* root_;
+
+    // expansions partition references_ and allocate blocks of nodes, which live as long as the hierarchy
+    mutable std::vector<primitive_reference> references_;
+    mutable std::vector<std::unique_ptr<node[]>> blocks_;
+    mutable std::atomic<size_t> num_nodes_;
+
+    // guards blocks_ and signals the end of expansions to threads waiting for them
+    mutable std::mutex mutex_;
+    mutable std::condition_variable expansion_finished_;
+};
+
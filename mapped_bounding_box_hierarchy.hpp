@@ -0,0 +1,734 @@
+#pragma once
+
+#include <vector>
+#include <array>
+#include <numeric>
+#include <algorithm>
+#include <utility>
+#include <tuple>
+#include <limits>
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+#include <cerrno>
+#include <string>
+#include <memory>
+#include <system_error>
+#include <stdexcept>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bounding_box_traits.hpp"
+#include "hierarchy_common.hpp"
+#include "partitioner.hpp"
+
+
+// a read-only memory mapping of a file of trivially copyable Ts
+// mapped_array is a ContiguousRange, and it is also a chunked source for mapped_bounding_box_hierarchy::build()
+template<class T>
+class mapped_array
+{
+  static_assert(std::is_trivially_copyable<T>::value, "mapped_array<T> requires trivially copyable T.");
+
+  public:
+    explicit mapped_array(const std::string& filename)
+      : data_(nullptr),
+        size_(0)
+    {
+      int fd = ::open(filename.c_str(), O_RDONLY);
+      if(fd == -1)
+      {
+        throw std::system_error(errno, std::generic_category(), "mapped_array: couldn't open " + filename);
+      }
+
+      struct stat status;
+      if(::fstat(fd, &status) == -1)
+      {
+        int error = errno;
+        ::close(fd);
+        throw std::system_error(error, std::generic_category(), "mapped_array: couldn't stat " + filename);
+      }
+
+      size_ = status.st_size / sizeof(T);
+
+      if(size_ > 0)
+      {
+        void* ptr = ::mmap(nullptr, size_ * sizeof(T), PROT_READ, MAP_SHARED, fd, 0);
+        if(ptr == MAP_FAILED)
+        {
+          int error = errno;
+          ::close(fd);
+          throw std::system_error(error, std::generic_category(), "mapped_array: couldn't map " + filename);
+        }
+
+        data_ = static_cast<const T*>(ptr);
+      }
+
+      // the mapping outlives the file descriptor
+      ::close(fd);
+    }
+
+    mapped_array(mapped_array&& other)
+      : data_(other.data_),
+        size_(other.size_)
+    {
+      other.data_ = nullptr;
+      other.size_ = 0;
+    }
+
+    ~mapped_array()
+    {
+      if(data_)
+      {
+        ::munmap(const_cast<T*>(data_), size_ * sizeof(T));
+      }
+    }
+
+    const T* begin() const
+    {
+      return data_;
+    }
+
+    const T* end() const
+    {
+      return data_ + size_;
+    }
+
+    const T* data() const
+    {
+      return data_;
+    }
+
+    size_t size() const
+    {
+      return size_;
+    }
+
+    const T& operator[](size_t i) const
+    {
+      return data_[i];
+    }
+
+    // copies count elements beginning at first into buffer and returns the number of elements copied
+    size_t read(size_t first, size_t count, T* buffer) const
+    {
+      count = std::min(count, size_ - std::min(first, size_));
+      std::copy(data_ + first, data_ + first + count, buffer);
+      return count;
+    }
+
+  private:
+    const T* data_;
+    size_t size_;
+};
+
+
+// a chunked source which reads trivially copyable Ts from a file with buffered i/o
+// unlike mapped_array, file_source never maps more than the chunk being read
+template<class T>
+class file_source
+{
+  static_assert(std::is_trivially_copyable<T>::value, "file_source<T> requires trivially copyable T.");
+
+  public:
+    explicit file_source(const std::string& filename)
+      : file_(std::fopen(filename.c_str(), "rb"), &std::fclose)
+    {
+      if(!file_)
+      {
+        throw std::system_error(errno, std::generic_category(), "file_source: couldn't open " + filename);
+      }
+
+      if(std::fseek(file_.get(), 0, SEEK_END) != 0)
+      {
+        throw std::system_error(errno, std::generic_category(), "file_source: couldn't seek " + filename);
+      }
+
+      long size = std::ftell(file_.get());
+      if(size < 0)
+      {
+        throw std::system_error(errno, std::generic_category(), "file_source: couldn't tell the size of " + filename);
+      }
+
+      size_ = size_t(size) / sizeof(T);
+    }
+
+    size_t size() const
+    {
+      return size_;
+    }
+
+    // throws std::system_error if the file can't be positioned at first
+    size_t read(size_t first, size_t count, T* buffer) const
+    {
+      if(std::fseek(file_.get(), long(first * sizeof(T)), SEEK_SET) != 0)
+      {
+        throw std::system_error(errno, std::generic_category(), "file_source: couldn't seek");
+      }
+
+      return std::fread(buffer, sizeof(T), count, file_.get());
+    }
+
+  private:
+    std::unique_ptr<std::FILE, int(*)(std::FILE*)> file_;
+    size_t size_;
+};
+
+
+// a bounding box hierarchy whose nodes live in a file
+// build() constructs the file from a chunked source of elements too large to fit in memory, and
+// mapped_bounding_box_hierarchy maps the file to query it without reading it into memory
+//
+// because the hierarchy refers to elements by their index in the source, queries require a ContiguousRange
+// of the same elements, such as a mapped_array of the file the source read from
+//
+// Dimension and Scalar describe the bounding boxes of the hierarchy, as for bounding_box_hierarchy
+template<class T,
+         size_t Dimension = element_bounding_box_traits<T>::dimension,
+         class Scalar = typename element_bounding_box_traits<T>::scalar_type>
+class mapped_bounding_box_hierarchy
+{
+  public:
+    using element_type = T;
+
+    using bounding_box_type = typename select_bounding_box_type<T,Dimension,Scalar>::type;
+
+    using scalar_type = Scalar;
+
+    static constexpr size_t dimension = Dimension;
+
+    static_assert(bounding_box_traits<bounding_box_type>::dimension == Dimension, "bounding_box_type must have Dimension axes.");
+
+
+    // builds a hierarchy over the elements of source and writes it to filename
+    // source is a chunked source: it has a member function .size() and a member function
+    // .read(first, count, buffer) which copies up to count elements beginning at first into buffer
+    //
+    // working memory is bounded by max_elements_in_memory elements' bounding boxes, plus one bounding box per bucket:
+    // 1. elements are streamed in chunks, and a reference to each, its index and its bounding box, is written to a temporary file
+    // 2. the references are spatially bucketed by the Morton code of their centroids into temporary files. buckets which
+    //    are still too large, such as a dense cluster inside a single Morton cell, are bucketed again in the same way
+    // 3. a subtree is built over each bucket independently
+    // 4. a top level is built over the subtrees' roots
+    //
+    // throws std::system_error if a file can't be read or written completely, e.g. because the disk is full
+    template<class Source,
+             class Bounder = call_member_bounding_box,
+             class Partitioner = minimize_surface_area_heuristic>
+    static void build(const Source& source,
+                      const std::string& filename,
+                      Bounder bounder = call_member_bounding_box(),
+                      Partitioner partitioner = minimize_surface_area_heuristic(),
+                      size_t max_elements_in_memory = size_t(1) << 22)
+    {
+      size_t num_elements = source.size();
+      max_elements_in_memory = std::max<size_t>(max_elements_in_memory, 1);
+      size_t chunk_size = std::min<size_t>(max_elements_in_memory, size_t(1) << 16);
+
+      std::FILE* output = std::fopen(filename.c_str(), "wb");
+      if(!output)
+      {
+        throw std::system_error(errno, std::generic_category(), "mapped_bounding_box_hierarchy: couldn't open " + filename);
+      }
+
+      try
+      {
+        // reserve space for the header
+        header h{magic, num_elements, 0, 0, minimize_surface_area_heuristic::empty_box<bounding_box_type>()};
+        write(output, &h, 1);
+
+        if(num_elements > 0)
+        {
+          // 1. write a reference to each element to a temporary file
+          file_pointer references = temporary_file();
+          {
+            std::vector<T> chunk(chunk_size);
+            std::vector<primitive_reference> refs(chunk_size);
+
+            for(size_t first = 0; first < num_elements; first += chunk_size)
+            {
+              size_t count = std::min(chunk_size, num_elements - first);
+              if(source.read(first, count, chunk.data()) != count)
+              {
+                throw std::system_error(errno, std::generic_category(), "mapped_bounding_box_hierarchy: couldn't read the source");
+              }
+
+              for(size_t i = 0; i < count; ++i)
+              {
+                refs[i] = primitive_reference{bounder(chunk[i]), (first + i) | leaf_bit};
+              }
+
+              write(references.get(), refs.data(), count);
+            }
+          }
+
+          // 2. and 3. bucket the references and build a subtree over each bucket
+          std::vector<primitive_reference> subtree_roots;
+          size_t num_nodes = 0;
+          build_buckets(references.get(), num_elements, output, num_nodes, subtree_roots, partitioner, max_elements_in_memory, chunk_size);
+          references.reset();
+
+          // 4. build the top level over the subtrees' roots
+          primitive_reference root = build_subtree(output, num_nodes, subtree_roots, partitioner);
+          h.root = root.index;
+          h.num_nodes = num_nodes;
+          h.bounding_box = root.bounding_box_;
+        }
+
+        // rewrite the header now that the root and its bounding box are known
+        std::rewind(output);
+        write(output, &h, 1);
+      }
+      catch(...)
+      {
+        std::fclose(output);
+        std::remove(filename.c_str());
+        throw;
+      }
+
+      // buffered writes which fail, e.g. when the disk is full, are only reported by the final flush
+      bool failed = std::ferror(output) != 0;
+      failed |= std::fclose(output) != 0;
+      if(failed)
+      {
+        int error = errno;
+        std::remove(filename.c_str());
+        throw std::system_error(error, std::generic_category(), "mapped_bounding_box_hierarchy: couldn't write " + filename);
+      }
+    }
+
+
+    // maps the hierarchy stored in filename
+    // elements must be the same range of elements the hierarchy was built from
+    // throws std::runtime_error if the file does not contain a complete hierarchy
+    //
+    // the file is data from disk, so every node's children are checked before it is queried: this reads each node once
+    template<class ContiguousRange>
+    mapped_bounding_box_hierarchy(const std::string& filename, const ContiguousRange& elements)
+      : file_(filename),
+        elements_(&*elements.begin())
+    {
+      if(file_.size() < sizeof(header) || file_header().magic != magic)
+      {
+        throw std::runtime_error("mapped_bounding_box_hierarchy: " + filename + " does not contain a hierarchy");
+      }
+
+      const header& h = file_header();
+
+      if(h.num_elements != size_t(elements.end() - elements.begin()))
+      {
+        throw std::runtime_error("mapped_bounding_box_hierarchy: " + filename + " was built from a different number of elements");
+      }
+
+      // the header is data from disk, so check that the nodes it describes lie within the file
+      if(h.num_nodes > (file_.size() - sizeof(header)) / sizeof(node))
+      {
+        throw std::runtime_error("mapped_bounding_box_hierarchy: " + filename + " is truncated");
+      }
+
+      if(h.num_elements > 0 && !is_valid_child(h.root, h.num_nodes))
+      {
+        throw std::runtime_error("mapped_bounding_box_hierarchy: " + filename + " has an invalid root");
+      }
+
+      // build() writes each node after its children, so requiring children to precede their parent
+      // also rules out cycles, which would otherwise make intersect() loop forever
+      for(uint64_t i = 0; i < h.num_nodes; ++i)
+      {
+        const node& n = node_at(i);
+        if(!is_valid_child(n.left_child_, i) || !is_valid_child(n.right_child_, i))
+        {
+          throw std::runtime_error("mapped_bounding_box_hierarchy: " + filename + " has an invalid node");
+        }
+      }
+    }
+
+
+    // build() stores the bounding box of the hierarchy in the header, so even a hierarchy whose root is an element
+    // returns the bounding box its bounder computed
+    bounding_box_type bounding_box() const
+    {
+      return file_header().bounding_box;
+    }
+
+
+    template<class Point, class Vector, class U,
+             class Function1 = call_member_intersect,
+             class Function2 = default_projection<Scalar>>
+    U intersect(Point origin, Vector direction, U init,
+                Function1 intersector = call_member_intersect(),
+                Function2 hit_time = default_projection<Scalar>()) const
+    {
+      U result = init;
+      auto result_t = hit_time(result);
+
+      if(file_header().num_elements == 0)
+      {
+        return result;
+      }
+
+      Vector one_over_direction;
+      std::array<bool,Dimension> is_negative;
+      for_each_axis<Dimension>([&](auto axis)
+      {
+        one_over_direction[axis] = Scalar(1) / direction[axis];
+        is_negative[axis] = std::signbit(direction[axis]);
+      });
+
+      // subtrees are balanced only within buckets, and the file may not have been built by build(), so the stack may grow
+      growable_stack<uint64_t,128> stack;
+      stack.push(file_header().root);
+
+      while(!stack.empty())
+      {
+        uint64_t current = stack.pop();
+
+        if(is_leaf(current))
+        {
+          auto current_result = intersector(element(current), origin, direction, result);
+          auto current_t = hit_time(current_result);
+          if(current_t < result_t)
+          {
+            result_t = current_t;
+            result = current_result;
+          }
+        }
+        else
+        {
+          const node& current_node = node_at(current);
+
+          if(intersect_box(current_node.bounding_box_, origin, one_over_direction, is_negative, result_t))
+          {
+            // push children to stack
+            stack.push(current_node.left_child_);
+            stack.push(current_node.right_child_);
+          }
+        }
+      }
+
+      return result;
+    }
+
+
+  private:
+    // the header holds the hierarchy's bounding box since "bbhmapp2", so files with the previous magic "bbhmappe" are rejected
+    static constexpr uint64_t magic = 0x6262686d61707032; // "bbhmapp2"
+
+    // a reference with its high bit set refers to an element, otherwise it refers to a node
+    static constexpr uint64_t leaf_bit = uint64_t(1) << 63;
+
+    // Morton cells are 18 bit codes whatever the Dimension, so that the per cell counts of build_buckets() stay small
+    static constexpr size_t morton_bits_per_axis = std::max<size_t>(1, 18 / Dimension);
+    static constexpr size_t num_cells = size_t(1) << (Dimension * morton_bits_per_axis);
+
+    // build_buckets() fills buckets with at least 1 / max_num_buckets of their references, so that consecutive buckets
+    // are more than full and at most 2 * max_num_buckets temporary files are open at each level of bucketing
+    static constexpr size_t max_num_buckets = 64;
+
+    struct header
+    {
+      uint64_t magic;
+      uint64_t num_elements;
+      uint64_t num_nodes;
+      uint64_t root;
+      bounding_box_type bounding_box;
+    };
+
+    struct node
+    {
+      bounding_box_type bounding_box_;
+      uint64_t left_child_;
+      uint64_t right_child_;
+    };
+
+    struct primitive_reference
+    {
+      bounding_box_type bounding_box_;
+      uint64_t index;
+    };
+
+    static_assert(std::is_trivially_copyable<node>::value, "mapped_bounding_box_hierarchy requires a trivially copyable bounding_box_type.");
+    static_assert(sizeof(header) % alignof(node) == 0, "the nodes following the header must be aligned.");
+
+
+    using file_pointer = std::unique_ptr<std::FILE, int(*)(std::FILE*)>;
+
+
+    static file_pointer temporary_file()
+    {
+      file_pointer result(std::tmpfile(), &std::fclose);
+      if(!result)
+      {
+        throw std::system_error(errno, std::generic_category(), "mapped_bounding_box_hierarchy: couldn't create temporary file");
+      }
+
+      return result;
+    }
+
+
+    template<class U>
+    static void write(std::FILE* file, const U* data, size_t count)
+    {
+      if(std::fwrite(data, sizeof(U), count, file) != count)
+      {
+        throw std::system_error(errno, std::generic_category(), "mapped_bounding_box_hierarchy: couldn't write");
+      }
+    }
+
+
+    // calls f(ref) for each of the num_refs references written to the temporary file, reading them in chunks
+    template<class Function>
+    static void for_each_reference(std::FILE* file, size_t num_refs, size_t chunk_size, Function f)
+    {
+      // a failed write to a temporary file may only be reported when it is flushed
+      if(std::fflush(file) != 0 || std::ferror(file))
+      {
+        throw std::system_error(errno, std::generic_category(), "mapped_bounding_box_hierarchy: couldn't write temporary file");
+      }
+
+      std::rewind(file);
+
+      std::vector<primitive_reference> chunk(std::min(chunk_size, num_refs));
+      for(size_t first = 0; first < num_refs; first += chunk.size())
+      {
+        size_t count = std::min(chunk.size(), num_refs - first);
+        if(std::fread(chunk.data(), sizeof(primitive_reference), count, file) != count)
+        {
+          throw std::system_error(errno, std::generic_category(), "mapped_bounding_box_hierarchy: couldn't read temporary file");
+        }
+
+        for(size_t i = 0; i < count; ++i)
+        {
+          f(chunk[i]);
+        }
+      }
+    }
+
+
+    // builds subtrees over the num_refs references in the temporary file input and appends their roots to subtree_roots
+    // references which don't fit in memory are bucketed spatially into further temporary files, and each bucket is built recursively
+    template<class Partitioner>
+    static void build_buckets(std::FILE* input,
+                              size_t num_refs,
+                              std::FILE* output,
+                              size_t& num_nodes,
+                              std::vector<primitive_reference>& subtree_roots,
+                              Partitioner partitioner,
+                              size_t max_elements_in_memory,
+                              size_t chunk_size)
+    {
+      if(num_refs <= max_elements_in_memory)
+      {
+        std::vector<primitive_reference> refs;
+        refs.reserve(num_refs);
+        for_each_reference(input, num_refs, chunk_size, [&](const primitive_reference& ref)
+        {
+          refs.push_back(ref);
+        });
+
+        subtree_roots.push_back(build_subtree(output, num_nodes, refs, partitioner));
+        return;
+      }
+
+      // find the bounding box of the references' centroids
+      bounding_box_type centroid_bounding_box = minimize_surface_area_heuristic::empty_box<bounding_box_type>();
+      for_each_reference(input, num_refs, chunk_size, [&](const primitive_reference& ref)
+      {
+        centroid_bounding_box = minimize_surface_area_heuristic::add_point_to_bounding_box(centroid_bounding_box, minimize_surface_area_heuristic::centroid(ref.bounding_box_));
+      });
+
+      // each bucket is a temporary file, so to keep few files open, buckets may hold more references than fit in memory
+      // such buckets are bucketed again within their own bounds
+      size_t bucket_capacity = std::max(max_elements_in_memory, (num_refs + max_num_buckets - 1) / max_num_buckets);
+
+      // count the references in each Morton cell and group consecutive cells into buckets of at most bucket_capacity
+      // references, unless a single cell holds more
+      std::vector<size_t> cell_to_bucket(num_cells);
+      {
+        std::vector<size_t> cell_counts(num_cells);
+        for_each_reference(input, num_refs, chunk_size, [&](const primitive_reference& ref)
+        {
+          ++cell_counts[morton_cell(ref.bounding_box_, centroid_bounding_box)];
+        });
+
+        size_t bucket = 0;
+        size_t num_elements_in_bucket = 0;
+        for(size_t cell = 0; cell < num_cells; ++cell)
+        {
+          if(cell_counts[cell] > 0 && num_elements_in_bucket > 0 && num_elements_in_bucket + cell_counts[cell] > bucket_capacity)
+          {
+            ++bucket;
+            num_elements_in_bucket = 0;
+          }
+
+          cell_to_bucket[cell] = bucket;
+          num_elements_in_bucket += cell_counts[cell];
+        }
+      }
+
+      size_t num_buckets = cell_to_bucket.back() + 1;
+
+      // if every reference lies in a single cell, their centroids are equal and no grid can divide them,
+      // so bucket them in the order they were written instead
+      bool bucket_by_order = num_buckets == 1;
+      if(bucket_by_order)
+      {
+        num_buckets = (num_refs + bucket_capacity - 1) / bucket_capacity;
+      }
+
+      // scatter each reference to its bucket's temporary file
+      std::vector<file_pointer> bucket_files;
+      std::vector<size_t> bucket_sizes(num_buckets);
+      for(size_t i = 0; i < num_buckets; ++i)
+      {
+        bucket_files.push_back(temporary_file());
+      }
+
+      size_t i = 0;
+      for_each_reference(input, num_refs, chunk_size, [&](const primitive_reference& ref)
+      {
+        size_t bucket = bucket_by_order ? i / bucket_capacity : cell_to_bucket[morton_cell(ref.bounding_box_, centroid_bounding_box)];
+        write(bucket_files[bucket].get(), &ref, 1);
+        ++bucket_sizes[bucket];
+        ++i;
+      });
+
+      cell_to_bucket = std::vector<size_t>();
+
+      for(size_t bucket = 0; bucket < num_buckets; ++bucket)
+      {
+        if(bucket_sizes[bucket] > 0)
+        {
+          build_buckets(bucket_files[bucket].get(), bucket_sizes[bucket], output, num_nodes, subtree_roots, partitioner, max_elements_in_memory, chunk_size);
+        }
+
+        bucket_files[bucket].reset();
+      }
+    }
+
+
+    static uint64_t spread_bits(uint64_t x)
+    {
+      uint64_t result = 0;
+      for(size_t i = 0; i < morton_bits_per_axis; ++i)
+      {
+        result |= ((x >> i) & 1) << (Dimension * i);
+      }
+
+      return result;
+    }
+
+
+    static size_t morton_cell(const bounding_box_type& box, const bounding_box_type& centroid_bounding_box)
+    {
+      auto c = minimize_surface_area_heuristic::centroid(box);
+
+      uint64_t result = 0;
+      for_each_axis<Dimension>([&](auto axis)
+      {
+        Scalar extent = centroid_bounding_box[1][axis] - centroid_bounding_box[0][axis];
+        Scalar x = extent > 0 ? (c[axis] - centroid_bounding_box[0][axis]) / extent : Scalar(0);
+
+        uint64_t max_coordinate = (uint64_t(1) << morton_bits_per_axis) - 1;
+        uint64_t coordinate = std::min<uint64_t>(max_coordinate, uint64_t(std::max(Scalar(0), x) * (max_coordinate + 1)));
+
+        result |= spread_bits(coordinate) << axis;
+      });
+
+      return result;
+    }
+
+
+    // builds a subtree over refs with partitioner, appends its nodes to output and returns a reference to its root
+    template<class Partitioner>
+    static primitive_reference build_subtree(std::FILE* output, size_t& num_nodes, const std::vector<primitive_reference>& refs, Partitioner partitioner)
+    {
+      std::vector<size_t> indices(refs.size());
+      std::iota(indices.begin(), indices.end(), 0);
+
+      auto bounder = [&](size_t i)
+      {
+        return refs[i].bounding_box_;
+      };
+
+      std::vector<node> subtree;
+      subtree.reserve(refs.size() - 1);
+
+      primitive_reference root = build_subtree_recursive(subtree, num_nodes, indices.begin(), indices.end(), refs, bounder, partitioner);
+
+      write(output, subtree.data(), subtree.size());
+      num_nodes += subtree.size();
+
+      return root;
+    }
+
+
+    template<class IndirectBounder, class Partitioner>
+    static primitive_reference build_subtree_recursive(std::vector<node>& subtree,
+                                                       size_t first_node,
+                                                       std::vector<size_t>::iterator begin,
+                                                       std::vector<size_t>::iterator end,
+                                                       const std::vector<primitive_reference>& refs,
+                                                       IndirectBounder bounder,
+                                                       Partitioner partitioner)
+    {
+      if(begin + 1 == end)
+      {
+        // we've hit a leaf of this subtree, which is either an element or the root of another subtree
+        return refs[*begin];
+      }
+
+      // find the bounding box of the refs
+      bounding_box_type box = minimize_surface_area_heuristic::empty_box<bounding_box_type>();
+      for(auto i = begin; i != end; ++i)
+      {
+        box = minimize_surface_area_heuristic::combine_bounding_boxes(box, bounder(*i));
+      }
+
+      // partition the refs into two sets
+      std::vector<size_t>::iterator split = partitioner(begin, end, box, bounder);
+
+      // build subtrees
+      primitive_reference left_child  = build_subtree_recursive(subtree, first_node, begin, split, refs, bounder, partitioner);
+      primitive_reference right_child = build_subtree_recursive(subtree, first_node, split, end,   refs, bounder, partitioner);
+
+      // create a new node
+      subtree.push_back(node{box, left_child.index, right_child.index});
+      return primitive_reference{box, first_node + subtree.size() - 1};
+    }
+
+
+    const header& file_header() const
+    {
+      return *reinterpret_cast<const header*>(file_.data());
+    }
+
+    const node& node_at(uint64_t idx) const
+    {
+      return reinterpret_cast<const node*>(file_.data() + sizeof(header))[idx];
+    }
+
+    static bool is_leaf(uint64_t ref)
+    {
+      return ref & leaf_bit;
+    }
+
+    // a valid child refers to an element of the hierarchy or to a node before node_limit
+    bool is_valid_child(uint64_t ref, uint64_t node_limit) const
+    {
+      return is_leaf(ref) ? (ref & ~leaf_bit) < file_header().num_elements : ref < node_limit;
+    }
+
+    const T& element(uint64_t ref) const
+    {
+      return elements_[ref & ~leaf_bit];
+    }
+
+    mapped_array<char> file_;
+    const T* elements_;
+};
+
@@ -0,0 +1,318 @@
+#pragma once
+
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <cstddef>
+#include <cstdint>
+
+#include "bounding_box_traits.hpp"
+#include "hierarchy_common.hpp"
+#include "partitioner.hpp"
+
+
+// a bounding box hierarchy over moving elements, for rendering with motion blur
+// each element is bounded at NumTimeKeys evenly spaced times, or keys, in [0,1], and each node stores its own box at every key
+// a query at time t interpolates each node's box between the keys on either side of t, so moving elements are culled
+// by boxes around where they are at time t rather than by boxes around everywhere they go during [0,1]
+//
+// between keys, an element's box must be bounded by the linear interpolation of its boxes at the keys, which is true
+// for example of triangles whose vertices move linearly between keys. nonlinear motion may be followed with more keys
+//
+// like bounding_box_hierarchy, the hierarchy refers to the elements it was built from without owning them,
+// and its const member functions may be called concurrently from any number of threads
+template<class T, size_t NumTimeKeys = 2>
+class motion_bounding_box_hierarchy
+{
+  private:
+    struct call_member_bounding_box
+    {
+      auto operator()(const T& element, size_t key) const
+      {
+        return element.bounding_box(key);
+      }
+    };
+
+
+    struct select_bounding_box_type
+    {
+      // if U::bounding_box(key) exists, use its type as the bounding box type
+      template<class U>
+      static auto test(int) -> decltype(std::declval<U>().bounding_box(size_t(0)));
+
+      // otherwise, a bounding box is an array of two arrays of three floats
+      template<class>
+      static std::array<std::array<float,3>,2> test(...);
+
+      using type = decltype(test<T>(0));
+    };
+
+
+    using traits = bounding_box_traits<typename select_bounding_box_type::type>;
+
+    static constexpr size_t Dimension = traits::dimension;
+
+    using Scalar = typename traits::scalar_type;
+
+
+  public:
+    static_assert(NumTimeKeys >= 2, "NumTimeKeys must be at least 2.");
+
+    using element_type = T;
+
+    using bounding_box_type = typename select_bounding_box_type::type;
+
+    using scalar_type = Scalar;
+
+    static constexpr size_t dimension = Dimension;
+
+    static constexpr size_t num_time_keys = NumTimeKeys;
+
+
+    // bounder(element, key) returns element's bounding box at time key / (NumTimeKeys - 1)
+    // by default, bounder calls element.bounding_box(key)
+    // the partitioner splits elements by their bounding boxes halfway through [0,1]
+    // a hierarchy of no elements has an empty bounding box, and its queries return init
+    template<class ContiguousRange,
+             class Bounder = call_member_bounding_box,
+             class Partitioner = minimize_surface_area_heuristic>
+    motion_bounding_box_hierarchy(const ContiguousRange& elements,
+                                  Bounder bounder = call_member_bounding_box(),
+                                  Partitioner partitioner = minimize_surface_area_heuristic())
+      : elements_(elements.begin() == elements.end() ? nullptr : &*elements.begin()),
+        root_(no_root)
+    {
+      size_t num_elements = elements.end() - elements.begin();
+
+      std::vector<std::array<bounding_box_type,NumTimeKeys>> element_boxes(num_elements);
+      std::vector<primitive_reference> references(num_elements);
+      for(size_t i = 0; i < num_elements; ++i)
+      {
+        for(size_t key = 0; key < NumTimeKeys; ++key)
+        {
+          element_boxes[i][key] = bounder(elements_[i], key);
+        }
+
+        primitive_reference& ref = references[i];
+        ref.bounding_box_ = interpolate(element_boxes[i], Scalar(0.5));
+        ref.centroid_ = partition_largest_axis_at_middle_element::centroid(ref.bounding_box_);
+        ref.index_ = i;
+      }
+
+      if(num_elements == 0)
+      {
+        return;
+      }
+
+      // reserve n - 1 nodes
+      nodes_.reserve(num_elements - 1);
+
+      root_ = make_tree_recursive(references.begin(), references.end(), element_boxes, partitioner);
+      bounding_boxes_ = is_leaf(root_) ? element_boxes[root_ & ~leaf_bit] : nodes_[root_].boxes_;
+    }
+
+
+    // the bounding box of every element at the given time
+    bounding_box_type bounding_box(Scalar time) const
+    {
+      if(root_ == no_root)
+      {
+        return minimize_surface_area_heuristic::empty_box<bounding_box_type>();
+      }
+
+      return interpolate(bounding_boxes_, time);
+    }
+
+
+    // intersects a ray at the given time in [0,1]
+    // intersector(element, origin, direction, time, result) intersects the ray with element as it is at that time,
+    // and by default calls element.intersect(origin, direction, time, result)
+    template<class Point, class Vector, class U,
+             class Function1 = call_member_intersect,
+             class Function2 = default_projection<Scalar>>
+    U intersect(Point origin, Vector direction, Scalar time, U init,
+                Function1 intersector = call_member_intersect(),
+                Function2 hit_time = default_projection<Scalar>()) const
+    {
+      U result = init;
+      auto result_t = hit_time(result);
+
+      if(root_ == no_root)
+      {
+        return result;
+      }
+
+      Vector one_over_direction;
+      std::array<bool,Dimension> is_negative;
+      for_each_axis<Dimension>([&](auto axis)
+      {
+        one_over_direction[axis] = Scalar(1) / direction[axis];
+        is_negative[axis] = std::signbit(direction[axis]);
+      });
+
+      // the keys on either side of time, and time's fraction of the way between them
+      size_t key;
+      Scalar fraction;
+      find_keys(time, key, fraction);
+
+      growable_stack<size_t,64> stack;
+      stack.push(root_);
+
+      while(!stack.empty())
+      {
+        size_t current = stack.pop();
+
+        if(is_leaf(current))
+        {
+          auto current_result = intersector(element(current), origin, direction, time, result);
+          auto current_t = hit_time(current_result);
+          if(current_t < result_t)
+          {
+            result_t = current_t;
+            result = current_result;
+          }
+        }
+        else
+        {
+          const node& current_node = nodes_[current];
+
+          if(intersect_box(interpolate(current_node.boxes_, key, fraction), origin, one_over_direction, is_negative, result_t))
+          {
+            // push children to stack
+            stack.push(current_node.left_child_);
+            stack.push(current_node.right_child_);
+          }
+        }
+      }
+
+      return result;
+    }
+
+
+  private:
+    // a reference with its high bit set refers to an element, otherwise it refers to a node
+    static constexpr size_t leaf_bit = size_t(1) << (std::numeric_limits<size_t>::digits - 1);
+
+    // the root of a hierarchy of no elements
+    static constexpr size_t no_root = ~leaf_bit;
+
+
+    struct node
+    {
+      std::array<bounding_box_type,NumTimeKeys> boxes_;
+      size_t left_child_;
+      size_t right_child_;
+    };
+
+
+    // during construction, elements are partitioned by references which cache their boxes halfway through [0,1]
+    using primitive_reference = ::primitive_reference<bounding_box_type>;
+
+
+    static bool is_leaf(size_t ref)
+    {
+      return ref & leaf_bit;
+    }
+
+
+    const T& element(size_t ref) const
+    {
+      return elements_[ref & ~leaf_bit];
+    }
+
+
+    static void find_keys(Scalar time, size_t& key, Scalar& fraction)
+    {
+      Scalar x = time * Scalar(NumTimeKeys - 1);
+
+      // times outside of [0,1] are clamped
+      if(!(x > Scalar(0))) x = Scalar(0);
+      if(x > Scalar(NumTimeKeys - 1)) x = Scalar(NumTimeKeys - 1);
+
+      key = std::min(size_t(x), NumTimeKeys - 2);
+      fraction = x - Scalar(key);
+    }
+
+
+    static bounding_box_type interpolate(const std::array<bounding_box_type,NumTimeKeys>& boxes, size_t key, Scalar fraction)
+    {
+      bounding_box_type result;
+      for_each_axis<Dimension>([&](auto axis)
+      {
+        result[0][axis] = (Scalar(1) - fraction) * boxes[key][0][axis] + fraction * boxes[key + 1][0][axis];
+        result[1][axis] = (Scalar(1) - fraction) * boxes[key][1][axis] + fraction * boxes[key + 1][1][axis];
+      });
+
+      return result;
+    }
+
+
+    static bounding_box_type interpolate(const std::array<bounding_box_type,NumTimeKeys>& boxes, Scalar time)
+    {
+      size_t key;
+      Scalar fraction;
+      find_keys(time, key, fraction);
+
+      return interpolate(boxes, key, fraction);
+    }
+
+
+    template<class Iterator>
+    static bounding_box_type bounding_box(Iterator begin, Iterator end)
+    {
+      bounding_box_type result = minimize_surface_area_heuristic::empty_box<bounding_box_type>();
+
+      for(Iterator ref = begin; ref != end; ++ref)
+      {
+        result = minimize_surface_area_heuristic::combine_bounding_boxes(result, ref->bounding_box_);
+      }
+
+      return result;
+    }
+
+
+    template<class Partitioner>
+    size_t make_tree_recursive(typename std::vector<primitive_reference>::iterator begin,
+                               typename std::vector<primitive_reference>::iterator end,
+                               const std::vector<std::array<bounding_box_type,NumTimeKeys>>& element_boxes,
+                               Partitioner partitioner)
+    {
+      if(begin + 1 == end)
+      {
+        // we've hit a leaf, so refer to the element
+        return begin->index_ | leaf_bit;
+      }
+
+      // partition the elements into two sets
+      auto split = partitioner(begin, end, bounding_box(begin, end), reference_bounder());
+
+      // build subtrees
+      size_t left_child  = make_tree_recursive(begin, split, element_boxes, partitioner);
+      size_t right_child = make_tree_recursive(split, end,   element_boxes, partitioner);
+
+      // at each key, a node's box is the union of its children's boxes
+      node new_node;
+      new_node.left_child_ = left_child;
+      new_node.right_child_ = right_child;
+
+      const auto& left_boxes  = is_leaf(left_child)  ? element_boxes[left_child & ~leaf_bit]  : nodes_[left_child].boxes_;
+      const auto& right_boxes = is_leaf(right_child) ? element_boxes[right_child & ~leaf_bit] : nodes_[right_child].boxes_;
+
+      for(size_t key = 0; key < NumTimeKeys; ++key)
+      {
+        new_node.boxes_[key] = minimize_surface_area_heuristic::combine_bounding_boxes(left_boxes[key], right_boxes[key]);
+      }
+
+      nodes_.push_back(new_node);
+      return nodes_.size() - 1;
+    }
+
+
+    const T* elements_;
+    std::vector<node> nodes_;
+    size_t root_;
+    std::array<bounding_box_type,NumTimeKeys> bounding_boxes_;
+};
+
@@ -0,0 +1,244 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <thread>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <utility>
+#include <cstddef>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+
+// the cpus of each NUMA node of this machine, read from /sys/devices/system/node
+// if the topology is unknown, e.g. on other platforms, the machine is one node whose cpus are unknown
+class numa_topology
+{
+  public:
+    numa_topology()
+    {
+#ifdef __linux__
+      for(size_t node = 0; ; ++node)
+      {
+        std::ifstream cpulist("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        if(!cpulist) break;
+
+        std::string list;
+        std::getline(cpulist, list);
+        cpus_.push_back(parse_cpu_list(list));
+      }
+#endif
+
+      if(cpus_.empty())
+      {
+        cpus_.emplace_back();
+      }
+    }
+
+
+    size_t num_nodes() const
+    {
+      return cpus_.size();
+    }
+
+
+    const std::vector<int>& cpus(size_t node) const
+    {
+      return cpus_[node];
+    }
+
+
+    // the node of the cpu the calling thread is running on
+    size_t current_node() const
+    {
+#ifdef __linux__
+      int cpu = sched_getcpu();
+      for(size_t node = 0; node < cpus_.size(); ++node)
+      {
+        for(int c : cpus_[node])
+        {
+          if(c == cpu) return node;
+        }
+      }
+#endif
+
+      return 0;
+    }
+
+
+    // as current_node(), but asks the kernel for the calling thread's cpu only once every refresh_interval calls
+    // the node is cached per thread, so a thread which moves to another node may see its old node for up to refresh_interval calls
+    size_t cached_current_node(size_t refresh_interval) const
+    {
+      thread_local size_t node = 0;
+      thread_local size_t num_calls_until_refresh = 0;
+
+      if(num_calls_until_refresh == 0)
+      {
+        node = current_node();
+        num_calls_until_refresh = refresh_interval;
+      }
+
+      --num_calls_until_refresh;
+      return node;
+    }
+
+
+    // restricts the calling thread to the cpus of node. does nothing if they are unknown
+    void bind_current_thread(size_t node) const
+    {
+#ifdef __linux__
+      if(cpus_[node].empty()) return;
+
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      for(int c : cpus_[node])
+      {
+        CPU_SET(c, &set);
+      }
+
+      sched_setaffinity(0, sizeof(set), &set);
+#else
+      (void)node;
+#endif
+    }
+
+
+  private:
+    // parses a list of cpus like "0-3,8-11"
+    static std::vector<int> parse_cpu_list(const std::string& list)
+    {
+      std::vector<int> result;
+
+      std::stringstream ranges(list);
+      std::string range;
+      while(std::getline(ranges, range, ','))
+      {
+        if(range.empty()) continue;
+
+        size_t dash = range.find('-');
+        int first = std::stoi(range.substr(0, dash));
+        int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+
+        for(int c = first; c <= last; ++c)
+        {
+          result.push_back(c);
+        }
+      }
+
+      return result;
+    }
+
+    std::vector<std::vector<int>> cpus_;
+};
+
+
+// a read-only Hierarchy with a replica on each NUMA node, for machines with several sockets
+// the hierarchy is built once. then, a thread bound to each NUMA node copies the elements and the hierarchy,
+// so that the pages of each replica are first touched, and placed, on its own node
+// queries are answered by the replica local to the calling thread. like Hierarchy, the replicas' const member functions
+// may be called concurrently from any number of threads, but threads should stay on one node, e.g. by binding them
+// with numa_topology::bind_current_thread(), or their queries may use a remote replica
+template<class Hierarchy>
+class numa_replicated_hierarchy
+{
+  public:
+    using hierarchy_type = Hierarchy;
+
+    using element_type = typename Hierarchy::element_type;
+
+    using bounding_box_type = typename Hierarchy::bounding_box_type;
+
+    // the number of calls to local_replica() on each thread between checks of which NUMA node the thread is on
+    static constexpr size_t node_refresh_interval = 1024;
+
+
+    template<class ContiguousRange, class... Args>
+    explicit numa_replicated_hierarchy(const ContiguousRange& elements, Args&&... args)
+    {
+      // build once
+      Hierarchy original(elements, std::forward<Args>(args)...);
+
+      replicas_.resize(topology_.num_nodes());
+
+      std::vector<std::thread> threads;
+      for(size_t node = 0; node < topology_.num_nodes(); ++node)
+      {
+        threads.emplace_back([&,node]
+        {
+          topology_.bind_current_thread(node);
+          replicas_[node] = std::make_unique<replica>(original, elements);
+        });
+      }
+
+      for(auto& thread : threads)
+      {
+        thread.join();
+      }
+    }
+
+
+    const numa_topology& topology() const
+    {
+      return topology_;
+    }
+
+
+    size_t num_replicas() const
+    {
+      return replicas_.size();
+    }
+
+
+    const Hierarchy& replica_on_node(size_t node) const
+    {
+      return replicas_[node]->hierarchy_;
+    }
+
+
+    // the replica on the calling thread's NUMA node
+    // the node is cached per thread and refreshed every node_refresh_interval calls, so that queries do not each pay for
+    // a system call. a thread which moves to another node may use its old node's replica until the next refresh
+    const Hierarchy& local_replica() const
+    {
+      size_t node = topology_.cached_current_node(node_refresh_interval);
+      return replica_on_node(node < replicas_.size() ? node : 0);
+    }
+
+
+    bounding_box_type bounding_box() const
+    {
+      return local_replica().bounding_box();
+    }
+
+
+    template<class... Args>
+    auto intersect(Args&&... args) const
+    {
+      return local_replica().intersect(std::forward<Args>(args)...);
+    }
+
+
+  private:
+    using element_allocator = typename std::allocator_traits<typename Hierarchy::allocator_type>::template rebind_alloc<element_type>;
+
+    struct replica
+    {
+      template<class ContiguousRange>
+      replica(const Hierarchy& original, const ContiguousRange& elements)
+        : elements_(elements.begin(), elements.end()),
+          hierarchy_(original, elements_)
+      {}
+
+      std::vector<element_type, element_allocator> elements_;
+      Hierarchy hierarchy_;
+    };
+
+    numa_topology topology_;
+    std::vector<std::unique_ptr<replica>> replicas_;
+};
+
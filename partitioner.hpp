@@ -1,37 +1,73 @@
 #pragma once
 
 #include <array>
+#include <vector>
+#include <memory>
 #include <algorithm>
 #include <limits>
+#include <cstddef>
+
+#include "bounding_box_traits.hpp"
 
 
 struct partition_largest_axis_at_middle_element
 {
   template<class BoundingBox>
-  static std::array<float,3> centroid(const BoundingBox& box)
+  static auto centroid(const BoundingBox& box)
   {
-    std::array<float,3> result{(box[1][0] + box[0][0])/2,
-                               (box[1][1] + box[0][1])/2,
-                               (box[1][2] + box[0][2])/2};
+    using traits = bounding_box_traits<BoundingBox>;
+
+    std::array<typename traits::scalar_type, traits::dimension> result;
+    for_each_axis<traits::dimension>([&](auto axis)
+    {
+      result[axis] = (box[1][axis] + box[0][axis])/2;
+    });
+
     return result;
   }
 
 
+  // returns the centroid of element's bounding box
+  // a bounder with a member function .centroid(element) may cache centroids to avoid recomputing them
+  template<class Bounder, class Element>
+  static auto centroid_of(const Bounder& bounder, const Element& element)
+  {
+    return centroid_of(bounder, element, 0);
+  }
+
+
+  template<class Bounder, class Element>
+  static auto centroid_of(const Bounder& bounder, const Element& element, int) -> decltype(bounder.centroid(element))
+  {
+    return bounder.centroid(element);
+  }
+
+
+  template<class Bounder, class Element>
+  static auto centroid_of(const Bounder& bounder, const Element& element, long)
+  {
+    return centroid(bounder(element));
+  }
+
+
   template<class BoundingBox>
   static size_t largest_axis(const BoundingBox& box)
   {
+    using traits = bounding_box_traits<BoundingBox>;
+    using scalar_type = typename traits::scalar_type;
+
     // find the largest dimension of the box
     size_t axis = 0;
-    float largest_length = -std::numeric_limits<float>::infinity();
-    for(size_t i = 0; i < 3; ++i)
+    scalar_type largest_length = -std::numeric_limits<scalar_type>::infinity();
+    for_each_axis<traits::dimension>([&](auto i)
     {
-      float length = box[1][i] - box[0][i];
+      scalar_type length = box[1][i] - box[0][i];
       if(length > largest_length)
       {
         largest_length = length;
         axis = i;
       }
-    }
+    });
   
     return axis;
   }
@@ -47,8 +83,8 @@ struct partition_largest_axis_at_middle_element
     template<class Element>
     bool operator()(const Element& lhs, const Element& rhs) const
     {
-      auto lhs_val = centroid(bounder(lhs))[axis];
-      auto rhs_val = centroid(bounder(rhs))[axis];
+      auto lhs_val = centroid_of(bounder, lhs)[axis];
+      auto rhs_val = centroid_of(bounder, rhs)[axis];
 
       return lhs_val < rhs_val;
     }
@@ -77,20 +113,33 @@ struct partition_largest_axis_at_middle_element
 struct minimize_surface_area_heuristic
 {
   template<class BoundingBox>
-  static std::array<float,3> centroid(const BoundingBox& box)
+  static auto centroid(const BoundingBox& box)
   {
-    std::array<float,3> result{(box[1][0] + box[0][0])/2,
-                               (box[1][1] + box[0][1])/2,
-                               (box[1][2] + box[0][2])/2};
-    return result;
+    return partition_largest_axis_at_middle_element::centroid(box);
+  }
+
+
+  template<class Bounder, class Element>
+  static auto centroid_of(const Bounder& bounder, const Element& element)
+  {
+    return partition_largest_axis_at_middle_element::centroid_of(bounder, element);
   }
 
 
   template<class BoundingBox>
   static BoundingBox empty_box()
   {
-    float inf = std::numeric_limits<float>::infinity();
-    BoundingBox result{{{inf, inf, inf}, {-inf, -inf, -inf}}};
+    using traits = bounding_box_traits<BoundingBox>;
+
+    auto inf = std::numeric_limits<typename traits::scalar_type>::infinity();
+
+    BoundingBox result;
+    for_each_axis<traits::dimension>([&](auto axis)
+    {
+      result[0][axis] =  inf;
+      result[1][axis] = -inf;
+    });
+
     return result;
   }
 
@@ -100,11 +149,11 @@ struct minimize_surface_area_heuristic
   {
     BoundingBox1 result = a;
   
-    for(int i = 0; i < 3; ++i)
+    for_each_axis<bounding_box_traits<BoundingBox1>::dimension>([&](auto i)
     {
       result[0][i] = std::min(result[0][i], b[0][i]);
       result[1][i] = std::max(result[1][i], b[1][i]);
-    }
+    });
   
     return result;
   }
@@ -115,42 +164,106 @@ struct minimize_surface_area_heuristic
   {
     BoundingBox result = b;
   
-    for(int i = 0; i < 3; ++i)
+    for_each_axis<bounding_box_traits<BoundingBox>::dimension>([&](auto i)
     {
       result[0][i] = std::min(result[0][i], p[i]);
       result[1][i] = std::max(result[1][i], p[i]);
-    }
+    });
   
     return result;
   }
 
 
+  // in three dimensions, the area of the box's faces
+  template<class BoundingBox>
+  static auto surface_area(const BoundingBox& box, std::integral_constant<size_t,3>)
+  {
+    auto width  = box[1][0] - box[0][0];
+    auto height = box[1][1] - box[0][1];
+    auto depth  = box[1][2] - box[0][2];
+
+    return 2 * (width * height + width * depth + height * depth);
+  }
+
+
+  // in two dimensions, the perimeter of the box
   template<class BoundingBox>
-  static float surface_area(const BoundingBox& box)
+  static auto surface_area(const BoundingBox& box, std::integral_constant<size_t,2>)
   {
-    float width  = box[1][0] - box[0][0];
-    float height = box[1][1] - box[0][1];
-    float depth  = box[1][2] - box[0][2];
+    auto width  = box[1][0] - box[0][0];
+    auto height = box[1][1] - box[0][1];
 
-    return 2.f * (width * height + width * depth + height * depth);
+    return 2 * (width + height);
+  }
+
+
+  // in general, the measure of the box's boundary
+  template<class BoundingBox, size_t Dimension>
+  static auto surface_area(const BoundingBox& box, std::integral_constant<size_t,Dimension>)
+  {
+    using scalar_type = typename bounding_box_traits<BoundingBox>::scalar_type;
+
+    // sum the measures of the facets orthogonal to each axis
+    scalar_type result = 0;
+    for_each_axis<Dimension>([&](auto i)
+    {
+      scalar_type facet = 1;
+      for_each_axis<Dimension>([&](auto j)
+      {
+        if(i != j) facet *= box[1][j] - box[0][j];
+      });
+
+      result += facet;
+    });
+
+    return 2 * result;
+  }
+
+
+  template<class BoundingBox>
+  static auto surface_area(const BoundingBox& box)
+  {
+    return surface_area(box, std::integral_constant<size_t,bounding_box_traits<BoundingBox>::dimension>());
   }
 
 
   template<class Iterator, class BoundingBox, class Bounder>
   Iterator operator()(Iterator first, Iterator last, const BoundingBox& box, Bounder bounder) const
   {
+    using scalar_type = typename bounding_box_traits<BoundingBox>::scalar_type;
+
+    return partition_at_minimal_cost(first, last, box, bounder,
+      [](const BoundingBox& left_box, size_t num_elements_in_left_partition, const BoundingBox& right_box, size_t num_elements_in_right_partition)
+    {
+      scalar_type left_area = surface_area(left_box);
+      scalar_type right_area = surface_area(right_box);
+
+      // compute the surface area heuristic cost of the proposed split
+      return left_area * scalar_type(num_elements_in_left_partition) + right_area * scalar_type(num_elements_in_right_partition);
+    });
+  }
+
+
+  // partitions the elements at the candidate split with minimal cost(left_box, num_left, right_box, num_right)
+  // candidate splits are evenly spaced along each axis of the bounding box of the elements' centroids
+  template<class Iterator, class BoundingBox, class Bounder, class CostFunction>
+  static Iterator partition_at_minimal_cost(Iterator first, Iterator last, const BoundingBox& box, Bounder bounder, CostFunction cost)
+  {
+    using traits = bounding_box_traits<BoundingBox>;
+    using scalar_type = typename traits::scalar_type;
+
     // compute the bounding box of elements' centroids
     BoundingBox centroid_bounding_box = empty_box<BoundingBox>();
     for(Iterator i = first; i != last; ++i)
     {
-      centroid_bounding_box = add_point_to_bounding_box(centroid_bounding_box, centroid(bounder(*i)));
+      centroid_bounding_box = add_point_to_bounding_box(centroid_bounding_box, centroid_of(bounder, *i));
     }
 
     struct bucket
     {
-      float cost;
-      int axis;
-      float centroid;
+      scalar_type cost;
+      size_t axis;
+      scalar_type centroid;
       size_t num_elements_in_left_partition;
       BoundingBox left_box;
       BoundingBox right_box;
@@ -169,20 +282,20 @@ struct minimize_surface_area_heuristic
 
     // initialize buckets' axes and centroids
     constexpr size_t num_buckets_per_axis = 10;
-    std::array<bucket, 3 * num_buckets_per_axis> buckets;
+    std::array<bucket, traits::dimension * num_buckets_per_axis> buckets;
 
-    for(int axis = 0; axis < 3; ++axis)
+    for(size_t axis = 0; axis < traits::dimension; ++axis)
     {
-      int axis_begin = axis * num_buckets_per_axis;
-      int axis_end = axis_begin + num_buckets_per_axis;
+      size_t axis_begin = axis * num_buckets_per_axis;
+      size_t axis_end = axis_begin + num_buckets_per_axis;
 
-      float buckets_min = centroid_bounding_box[0][axis];
-      float buckets_max = centroid_bounding_box[1][axis];
-      float bucket_width = (buckets_max - buckets_min) / num_buckets_per_axis;
+      scalar_type buckets_min = centroid_bounding_box[0][axis];
+      scalar_type buckets_max = centroid_bounding_box[1][axis];
+      scalar_type bucket_width = (buckets_max - buckets_min) / num_buckets_per_axis;
 
       buckets[axis_begin].axis = axis;
       buckets[axis_begin].centroid = buckets_min + bucket_width/2;
-      for(int i = axis_begin + 1; i < axis_end; ++i)
+      for(size_t i = axis_begin + 1; i < axis_end; ++i)
       {
         // each bucket's centroid is at an offset bucket_width from the previous
         buckets[i].axis = axis;
@@ -190,23 +303,65 @@ struct minimize_surface_area_heuristic
       }
     }
 
+    // an element falls to the left of every bucket whose centroid is greater than its own, and because buckets'
+    // centroids increase along each axis, those buckets are a suffix of the axis' buckets
+    // so, rather than add each element to the left or right box of every bucket, bin each element by the first
+    // bucket it falls to the left of, and then sweep the bins to find each bucket's left and right boxes
+    struct bin
+    {
+      size_t num_elements;
+      BoundingBox box;
+
+      bin()
+        : num_elements(0),
+          box(empty_box<BoundingBox>())
+      {}
+    };
+
+    std::array<std::array<bin, num_buckets_per_axis + 1>, traits::dimension> bins;
+
     for(Iterator i = first; i != last; ++i)
     {
-      auto this_box = bounder(*i);
-      auto this_centroid = centroid(this_box);
+      const auto& this_box = bounder(*i);
+      auto this_centroid = centroid_of(bounder, *i);
 
-      // for each bucket, find which side of its centroid element i falls into
-      for(bucket& b : buckets)
+      for(size_t axis = 0; axis < traits::dimension; ++axis)
       {
-        if(this_centroid[b.axis] < b.centroid)
-        {
-          b.left_box = combine_bounding_boxes(b.left_box, this_box);
-          ++b.num_elements_in_left_partition;
-        }
-        else
+        const bucket* axis_buckets = buckets.data() + axis * num_buckets_per_axis;
+
+        size_t b = 0;
+        while(b < num_buckets_per_axis && !(this_centroid[axis] < axis_buckets[b].centroid))
         {
-          b.right_box = combine_bounding_boxes(b.right_box, this_box);
+          ++b;
         }
+
+        bins[axis][b].box = combine_bounding_boxes(bins[axis][b].box, this_box);
+        ++bins[axis][b].num_elements;
+      }
+    }
+
+    for(size_t axis = 0; axis < traits::dimension; ++axis)
+    {
+      bucket* axis_buckets = buckets.data() + axis * num_buckets_per_axis;
+
+      // bucket b's left partition is bins [0, b]
+      BoundingBox left_box = empty_box<BoundingBox>();
+      size_t num_elements_in_left_partition = 0;
+      for(size_t b = 0; b < num_buckets_per_axis; ++b)
+      {
+        left_box = combine_bounding_boxes(left_box, bins[axis][b].box);
+        num_elements_in_left_partition += bins[axis][b].num_elements;
+
+        axis_buckets[b].left_box = left_box;
+        axis_buckets[b].num_elements_in_left_partition = num_elements_in_left_partition;
+      }
+
+      // bucket b's right partition is bins [b + 1, num_buckets_per_axis]
+      BoundingBox right_box = empty_box<BoundingBox>();
+      for(size_t b = num_buckets_per_axis; b-- > 0;)
+      {
+        right_box = combine_bounding_boxes(right_box, bins[axis][b + 1].box);
+        axis_buckets[b].right_box = right_box;
       }
     }
 
@@ -217,11 +372,7 @@ struct minimize_surface_area_heuristic
     {
       size_t num_elements_in_right_partition = num_elements - b.num_elements_in_left_partition; 
 
-      float left_area = surface_area(b.left_box);
-      float right_area = surface_area(b.right_box);
-
-      // compute the surface area heuristic cost of the proposed split
-      b.cost = left_area * float(b.num_elements_in_left_partition) + right_area * float(num_elements_in_right_partition);
+      b.cost = cost(b.left_box, b.num_elements_in_left_partition, b.right_box, num_elements_in_right_partition);
     }
 
     // remove buckets which have a NaN cost or which produce partitions with empty sets
@@ -242,9 +393,177 @@ struct minimize_surface_area_heuristic
     // partition the elements based on whether their centroids are on the left or the right of the selected bucket's centroid
     return std::partition(first, last, [&](const auto& element)
     {
-      int axis = selected_bucket->axis;
-      return centroid(bounder(element))[axis] < selected_bucket->centroid;
+      size_t axis = selected_bucket->axis;
+      return centroid_of(bounder, element)[axis] < selected_bucket->centroid;
     });
   }
 };
 
+
+
+// like minimize_surface_area_heuristic, but estimates the probability that a ray which hits a node also hits one of
+// its children from a sample of representative rays, e.g. rays from a known camera or towards known lights,
+// rather than from the children's surface areas, which assumes that rays are distributed uniformly
+// where fewer than min_num_rays sample rays hit a node, or the node has fewer than min_num_elements elements,
+// the node is partitioned by minimize_surface_area_heuristic instead. a child which no sample ray hits is weighted
+// by its surface area, as a fraction of one ray, so that the sample's gaps don't make large children free
+//
+// operator() is not const: it records the sample rays that hit the node it partitions, and the hierarchies pass
+// their partitioner by value, so the copies which partition the node's children test only those rays rather than
+// the whole sample. a partitioner must not be called concurrently, but separate copies may be
+template<size_t Dimension = 3, class Scalar = float>
+class minimize_ray_distribution_heuristic
+{
+  public:
+    // each sample ray is the segment between origin and origin + max_t * direction
+    template<class RandomAccessIterator1, class RandomAccessIterator2>
+    minimize_ray_distribution_heuristic(RandomAccessIterator1 origins_first, RandomAccessIterator1 origins_last,
+                                        RandomAccessIterator2 directions_first,
+                                        Scalar max_t = std::numeric_limits<Scalar>::infinity(),
+                                        size_t min_num_rays = 64,
+                                        size_t min_num_elements = 64)
+      : max_t_(max_t),
+        min_num_rays_(min_num_rays),
+        min_num_elements_(min_num_elements)
+    {
+      auto rays = std::make_shared<std::vector<sample_ray>>();
+
+      for(; origins_first != origins_last; ++origins_first, ++directions_first)
+      {
+        sample_ray ray;
+        for_each_axis<Dimension>([&](auto axis)
+        {
+          ray.origin[axis] = (*origins_first)[axis];
+          ray.one_over_direction[axis] = Scalar(1) / (*directions_first)[axis];
+        });
+
+        rays->push_back(ray);
+      }
+
+      rays_ = std::move(rays);
+    }
+
+
+    template<class Iterator, class BoundingBox, class Bounder>
+    Iterator operator()(Iterator first, Iterator last, const BoundingBox& box, Bounder bounder)
+    {
+      if(size_t(last - first) < min_num_elements_)
+      {
+        return minimize_surface_area_heuristic()(first, last, box, bounder);
+      }
+
+      // find the sample rays which hit the node
+      // a ray which hits the node also hits every box containing it, so if the last node this partitioner partitioned
+      // contains this one, e.g. because it is this node's parent, only the rays which hit that node need to be tested
+      auto rays = std::make_shared<std::vector<const sample_ray*>>();
+      if(node_rays_ && contains(node_box_, box))
+      {
+        for(const sample_ray* ray : *node_rays_)
+        {
+          if(hits(*ray, box)) rays->push_back(ray);
+        }
+      }
+      else
+      {
+        for(const sample_ray& ray : *rays_)
+        {
+          if(hits(ray, box)) rays->push_back(&ray);
+        }
+      }
+
+      // remember the rays which hit this node for the copies which partition its children
+      node_rays_ = rays;
+      for_each_axis<Dimension>([&](auto axis)
+      {
+        node_box_[0][axis] = box[0][axis];
+        node_box_[1][axis] = box[1][axis];
+      });
+
+      if(rays->size() < min_num_rays_)
+      {
+        return minimize_surface_area_heuristic()(first, last, box, bounder);
+      }
+
+      Scalar area = Scalar(minimize_surface_area_heuristic::surface_area(box));
+
+      // the number of sample rays which hit a child is proportional to the probability that a ray hits it
+      // when no sample ray hits a child, the sample only says that fewer than one does, so the child's surface area
+      // estimates the rays which would hit it, capped at one
+      auto num_expected_hits = [&](size_t num_hits, const BoundingBox& child_box)
+      {
+        if(num_hits > 0)
+        {
+          return Scalar(num_hits);
+        }
+
+        Scalar fraction = area > 0 ? Scalar(minimize_surface_area_heuristic::surface_area(child_box)) / area : Scalar(1);
+        return std::min(Scalar(1), fraction * Scalar(rays->size()));
+      };
+
+      return minimize_surface_area_heuristic::partition_at_minimal_cost(first, last, box, bounder,
+        [&](const BoundingBox& left_box, size_t num_elements_in_left_partition, const BoundingBox& right_box, size_t num_elements_in_right_partition)
+      {
+        size_t num_left_hits = 0;
+        size_t num_right_hits = 0;
+        for(const sample_ray* ray : *rays)
+        {
+          num_left_hits  += hits(*ray, left_box);
+          num_right_hits += hits(*ray, right_box);
+        }
+
+        return num_expected_hits(num_left_hits, left_box) * Scalar(num_elements_in_left_partition) +
+               num_expected_hits(num_right_hits, right_box) * Scalar(num_elements_in_right_partition);
+      });
+    }
+
+
+  private:
+    struct sample_ray
+    {
+      std::array<Scalar,Dimension> origin;
+      std::array<Scalar,Dimension> one_over_direction;
+    };
+
+
+    template<class BoundingBox>
+    bool hits(const sample_ray& ray, const BoundingBox& box) const
+    {
+      Scalar tmin = 0;
+      Scalar tmax = max_t_;
+
+      for_each_axis<Dimension>([&](auto axis)
+      {
+        Scalar t0 = (box[0][axis] - ray.origin[axis]) * ray.one_over_direction[axis];
+        Scalar t1 = (box[1][axis] - ray.origin[axis]) * ray.one_over_direction[axis];
+
+        tmin = std::max(tmin, std::min(t0, t1));
+        tmax = std::min(tmax, std::max(t0, t1));
+      });
+
+      return tmin <= tmax;
+    }
+
+
+    template<class BoundingBox>
+    static bool contains(const std::array<std::array<Scalar,Dimension>,2>& outer, const BoundingBox& inner)
+    {
+      bool result = true;
+      for_each_axis<Dimension>([&](auto axis)
+      {
+        result &= (outer[0][axis] <= inner[0][axis]) & (inner[1][axis] <= outer[1][axis]);
+      });
+
+      return result;
+    }
+
+
+    // the sample is shared by copies of the partitioner, which are made at every node
+    std::shared_ptr<const std::vector<sample_ray>> rays_;
+    Scalar max_t_;
+    size_t min_num_rays_;
+    size_t min_num_elements_;
+
+    // the sample rays which hit the last node this partitioner partitioned, and that node's box
+    std::shared_ptr<const std::vector<const sample_ray*>> node_rays_;
+    std::array<std::array<Scalar,Dimension>,2> node_box_;
+};
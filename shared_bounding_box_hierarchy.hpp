@@ -0,0 +1,127 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <utility>
+#include <atomic>
+
+#include "bounding_box_hierarchy.hpp"
+
+
+// an immutable bounding_box_hierarchy which owns its elements
+// copies of a shared_bounding_box_hierarchy are cheap and share the same hierarchy and elements,
+// which live until the last copy is destroyed. like bounding_box_hierarchy, its const member functions
+// may be called concurrently from any number of threads
+template<class T,
+         size_t Dimension = element_bounding_box_traits<T>::dimension,
+         class Scalar = typename element_bounding_box_traits<T>::scalar_type>
+class shared_bounding_box_hierarchy
+{
+  public:
+    using hierarchy_type = bounding_box_hierarchy<T,Dimension,Scalar>;
+
+    using element_type = T;
+
+    using bounding_box_type = typename hierarchy_type::bounding_box_type;
+
+
+    // takes ownership of elements
+    template<class... Args>
+    explicit shared_bounding_box_hierarchy(std::vector<T> elements, Args&&... args)
+      : shared_bounding_box_hierarchy(std::make_shared<const std::vector<T>>(std::move(elements)), std::forward<Args>(args)...)
+    {}
+
+
+    // shares ownership of elements, e.g. with other hierarchies built from the same elements
+    template<class... Args>
+    explicit shared_bounding_box_hierarchy(std::shared_ptr<const std::vector<T>> elements, Args&&... args)
+      : state_(std::make_shared<const state>(std::move(elements), std::forward<Args>(args)...))
+    {}
+
+
+    const std::vector<T>& elements() const
+    {
+      return *state_->elements_;
+    }
+
+
+    // the elements' storage, which may be shared with other hierarchies
+    const std::shared_ptr<const std::vector<T>>& shared_elements() const
+    {
+      return state_->elements_;
+    }
+
+
+    const hierarchy_type& hierarchy() const
+    {
+      return state_->hierarchy_;
+    }
+
+
+    bounding_box_type bounding_box() const
+    {
+      return hierarchy().bounding_box();
+    }
+
+
+    template<class... Args>
+    auto intersect(Args&&... args) const
+    {
+      return hierarchy().intersect(std::forward<Args>(args)...);
+    }
+
+
+    template<class... Args>
+    auto intersect_tile(Args&&... args) const
+    {
+      return hierarchy().intersect_tile(std::forward<Args>(args)...);
+    }
+
+
+  private:
+    struct state
+    {
+      template<class... Args>
+      state(std::shared_ptr<const std::vector<T>> elements, Args&&... args)
+        : elements_(std::move(elements)),
+          hierarchy_(*elements_, std::forward<Args>(args)...)
+      {}
+
+      std::shared_ptr<const std::vector<T>> elements_;
+      hierarchy_type hierarchy_;
+    };
+
+    std::shared_ptr<const state> state_;
+};
+
+
+// publishes a hierarchy to concurrent readers and atomically replaces it, in the style of read-copy-update
+// readers take a snapshot with load() and may query it for as long as they hold it, even after
+// a newer hierarchy has been published. the old hierarchy is destroyed when its last snapshot is released
+template<class Hierarchy>
+class hierarchy_publisher
+{
+  public:
+    explicit hierarchy_publisher(Hierarchy hierarchy)
+      : current_(std::make_shared<const Hierarchy>(std::move(hierarchy)))
+    {}
+
+
+    std::shared_ptr<const Hierarchy> load() const
+    {
+      return std::atomic_load_explicit(&current_, std::memory_order_acquire);
+    }
+
+
+    // returns the previously published hierarchy
+    std::shared_ptr<const Hierarchy> publish(Hierarchy hierarchy)
+    {
+      auto replacement = std::make_shared<const Hierarchy>(std::move(hierarchy));
+      return std::atomic_exchange_explicit(&current_, std::move(replacement), std::memory_order_acq_rel);
+    }
+
+
+  private:
+    std::shared_ptr<const Hierarchy> current_;
+};
+
@@ -3,6 +3,20 @@
 #include <chrono>
 #include <cstddef>
 #include <utility>
+#include <array>
+#include <vector>
+#include <limits>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 template<class Duration, class Clock, class Function, class... Args>
 Duration time_invocation_in(const Clock& clock, std::size_t num_trials, Function&& f, Args&&... args)
@@ -44,3 +58,298 @@ std::size_t time_invocation_in_seconds(std::size_t num_trials, Function&& f, Arg
   return ::time_invocation_in<std::chrono::seconds>(std::chrono::system_clock(), num_trials, std::forward<Function>(f), std::forward<Args>(args)...).count();
 }
 
+
+
+// hardware performance counters, measured with perf_event_open on linux
+// counters which are unavailable, e.g. on other platforms, in virtual machines without a virtual PMU, or when
+// /proc/sys/kernel/perf_event_paranoid forbids them, are reported as NaN. wall-clock time is always available
+struct performance_sample
+{
+  enum metric
+  {
+    nanoseconds,
+    cycles,
+    instructions,
+    l1d_misses,
+    llc_misses,
+    branch_misses,
+    num_metrics
+  };
+
+  static const char* name(metric m)
+  {
+    static const char* names[] = {"ns", "cycles", "instructions", "L1d misses", "LLC misses", "branch misses"};
+    return names[m];
+  }
+
+  performance_sample()
+  {
+    values.fill(std::numeric_limits<double>::quiet_NaN());
+  }
+
+  double operator[](metric m) const
+  {
+    return values[m];
+  }
+
+  double& operator[](metric m)
+  {
+    return values[m];
+  }
+
+  std::array<double,num_metrics> values;
+};
+
+
+inline std::ostream& operator<<(std::ostream& os, const performance_sample& sample)
+{
+  for(int m = 0; m < performance_sample::num_metrics; ++m)
+  {
+    auto metric = performance_sample::metric(m);
+
+    if(m > 0) os << ", ";
+
+    if(std::isnan(sample[metric]))
+    {
+      os << "n/a " << performance_sample::name(metric);
+    }
+    else
+    {
+      os << sample[metric] << " " << performance_sample::name(metric);
+    }
+  }
+
+  return os;
+}
+
+
+// counts the calling thread's events, and those of the threads it creates while counting, between start() and stop()
+class performance_counters
+{
+  public:
+    performance_counters()
+    {
+      file_descriptors_.fill(-1);
+
+#ifdef __linux__
+      file_descriptors_[performance_sample::cycles]        = open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+      file_descriptors_[performance_sample::instructions]  = open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+      file_descriptors_[performance_sample::l1d_misses]    = open(PERF_TYPE_HW_CACHE,
+                                                                  PERF_COUNT_HW_CACHE_L1D |
+                                                                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                                                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+      file_descriptors_[performance_sample::llc_misses]    = open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+      file_descriptors_[performance_sample::branch_misses] = open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+#endif
+    }
+
+
+    performance_counters(const performance_counters&) = delete;
+
+    performance_counters& operator=(const performance_counters&) = delete;
+
+
+    ~performance_counters()
+    {
+#ifdef __linux__
+      for(int fd : file_descriptors_)
+      {
+        if(fd != -1) close(fd);
+      }
+#endif
+    }
+
+
+    // true if at least one hardware counter could be opened
+    bool is_available() const
+    {
+      for(int fd : file_descriptors_)
+      {
+        if(fd != -1) return true;
+      }
+
+      return false;
+    }
+
+
+    void start()
+    {
+#ifdef __linux__
+      for(int fd : file_descriptors_)
+      {
+        if(fd != -1)
+        {
+          ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+          ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+      }
+#endif
+
+      start_ = std::chrono::steady_clock::now();
+    }
+
+
+    performance_sample stop()
+    {
+      auto end = std::chrono::steady_clock::now();
+
+      performance_sample result;
+
+#ifdef __linux__
+      for(int m = 0; m < performance_sample::num_metrics; ++m)
+      {
+        int fd = file_descriptors_[m];
+        if(fd == -1) continue;
+
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+
+        // value, time enabled, time running
+        std::uint64_t buffer[3];
+        if(read(fd, buffer, sizeof(buffer)) == sizeof(buffer) && buffer[2] > 0)
+        {
+          // when there are more events than hardware counters, the kernel multiplexes them, so scale the count
+          // by the fraction of time that the counter was actually running
+          result[performance_sample::metric(m)] = double(buffer[0]) * double(buffer[1]) / double(buffer[2]);
+        }
+      }
+#endif
+
+      result[performance_sample::nanoseconds] = std::chrono::duration<double,std::nano>(end - start_).count();
+
+      return result;
+    }
+
+
+  private:
+#ifdef __linux__
+    static int open(std::uint32_t type, std::uint64_t config)
+    {
+      perf_event_attr attributes;
+      std::memset(&attributes, 0, sizeof(attributes));
+      attributes.type = type;
+      attributes.size = sizeof(attributes);
+      attributes.config = config;
+      attributes.disabled = 1;
+      attributes.inherit = 1;
+      attributes.exclude_kernel = 1;
+      attributes.exclude_hv = 1;
+      attributes.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+      // this thread, on any cpu, in no group
+      return static_cast<int>(syscall(__NR_perf_event_open, &attributes, 0, -1, -1, 0));
+    }
+#endif
+
+    std::array<int,performance_sample::num_metrics> file_descriptors_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+
+// measures the enclosing scope and stores the result in sample on exit, e.g.
+//
+//   performance_sample build;
+//   {
+//     scoped_performance_measurement measure(build);
+//     ...
+//   }
+class scoped_performance_measurement
+{
+  public:
+    explicit scoped_performance_measurement(performance_sample& result)
+      : result_(result)
+    {
+      counters_.start();
+    }
+
+
+    ~scoped_performance_measurement()
+    {
+      result_ = counters_.stop();
+    }
+
+
+  private:
+    performance_sample& result_;
+    performance_counters counters_;
+};
+
+
+// the samples of each trial of a measurement
+struct performance_statistics
+{
+  performance_sample mean() const
+  {
+    performance_sample result;
+    for(int m = 0; m < performance_sample::num_metrics; ++m)
+    {
+      double sum = 0;
+      for(const performance_sample& trial : trials)
+      {
+        sum += trial.values[m];
+      }
+
+      result.values[m] = sum / trials.size();
+    }
+
+    return result;
+  }
+
+
+  performance_sample standard_deviation() const
+  {
+    performance_sample mu = mean();
+
+    performance_sample result;
+    for(int m = 0; m < performance_sample::num_metrics; ++m)
+    {
+      double sum_of_squares = 0;
+      for(const performance_sample& trial : trials)
+      {
+        double deviation = trial.values[m] - mu.values[m];
+        sum_of_squares += deviation * deviation;
+      }
+
+      result.values[m] = trials.size() > 1 ? std::sqrt(sum_of_squares / (trials.size() - 1)) : 0;
+    }
+
+    return result;
+  }
+
+
+  performance_sample min() const
+  {
+    performance_sample result;
+    for(int m = 0; m < performance_sample::num_metrics; ++m)
+    {
+      for(const performance_sample& trial : trials)
+      {
+        if(std::isnan(result.values[m]) || trial.values[m] < result.values[m]) result.values[m] = trial.values[m];
+      }
+    }
+
+    return result;
+  }
+
+
+  std::vector<performance_sample> trials;
+};
+
+
+// like time_invocation_in, but measures each trial separately, with hardware counters where available
+template<class Function, class... Args>
+performance_statistics measure_invocation(std::size_t num_trials, Function&& f, Args&&... args)
+{
+  performance_counters counters;
+
+  performance_statistics result;
+  for(std::size_t i = 0;
+      i < num_trials;
+      ++i)
+  {
+    counters.start();
+    std::forward<Function>(f)(std::forward<Args&&>(args)...);
+    result.trials.push_back(counters.stop());
+  }
+
+  return result;
+}